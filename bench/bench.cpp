@@ -0,0 +1,553 @@
+// Headless benchmark for the plugin's DSP. Build and run with `make bench`.
+//
+// Each module is created through its Model without a ModuleWidget, so nothing
+// here touches the window or the GUI. The module's process() is then called
+// directly for a fixed length of audio.
+//
+//     bench [seconds]                  time components and modules
+//     bench render DIR [--summary]     write the scenarios' output to DIR
+//     bench compare DIR [options]      check the scenarios against DIR
+//
+// The scenarios are fixed patches (pitch sweeps, gate patterns, PWM and
+// switch changes) rendered to raw float32 files, one per scenario. Render a
+// reference before a DSP change and compare after it. compare fails if any
+// sample differs by more than --tolerance volts (1e-4 by default), or if a
+// module runs slower than its budget in defaultBudgets below. slug=ns
+// overrides a budget, e.g. sub_osc=2000, and 0 removes it.
+//
+// --summary writes a .sum file per scenario instead, holding a few values per
+// block of samples (see summarize()). These are small enough to commit, and
+// bench/golden holds them for `make test`. compare reads a .raw reference
+// when there is one and a .sum otherwise.
+#include "../src/plugin.hpp"
+#include "../src/dspcore.hpp"
+#include "../src/additive.hpp"
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <map>
+
+
+typedef std::chrono::steady_clock Clock;
+
+// Results are summed into this so the compiler cannot drop the work being timed
+static volatile float sink;
+
+template <class F>
+static double timeNs(int64_t frames, F f) {
+	Clock::time_point start = Clock::now();
+	for (int64_t i = 0; i < frames; i++)
+		f(i);
+	Clock::time_point end = Clock::now();
+	return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+static void printResult(const std::string& name, double ns, int64_t frames, float sampleRate) {
+	double nsPerSample = ns / frames;
+	double samplesPerSec = 1e9 / nsPerSample;
+	std::printf("%-44s %10.1f ns/sample %10.2f Msamples/s %8.1fx realtime\n",
+		name.c_str(), nsPerSample, samplesPerSec / 1e6, samplesPerSec / sampleRate);
+}
+
+
+static int findInput(Module* m, const std::string& name) {
+	for (size_t i = 0; i < m->inputInfos.size(); i++) {
+		if (m->inputInfos[i]->name == name)
+			return i;
+	}
+	return -1;
+}
+
+static int findOutput(Module* m, const std::string& name) {
+	for (size_t i = 0; i < m->outputInfos.size(); i++) {
+		if (m->outputInfos[i]->name == name)
+			return i;
+	}
+	return -1;
+}
+
+
+static int findParam(Module* m, const std::string& name) {
+	for (size_t i = 0; i < m->paramQuantities.size(); i++) {
+		if (m->paramQuantities[i]->name == name)
+			return i;
+	}
+	return -1;
+}
+
+
+struct ModuleBench {
+	Model* model;
+	// Port names used to drive and read the module
+	std::string pitchInput;
+	std::string gateInput;
+	std::string mainOutput;
+	// Module settings as JSON, as saved in a patch, or empty for the defaults
+	std::string settings;
+};
+
+static void benchModule(const ModuleBench& b, float sampleRate, int channels, bool allOutputs, double seconds) {
+	Module* m = b.model->createModule();
+	if (!b.settings.empty()) {
+		json_t* settingsJ = json_loads(b.settings.c_str(), 0, NULL);
+		m->dataFromJson(settingsJ);
+		json_decref(settingsJ);
+	}
+
+	Module::SampleRateChangeEvent e;
+	e.sampleRate = sampleRate;
+	e.sampleTime = 1.f / sampleRate;
+	m->onSampleRateChange(e);
+
+	// Connecting a cable gives a port at least one channel
+	for (size_t i = 0; i < m->outputs.size(); i++)
+		m->outputs[i].channels = allOutputs ? 1 : 0;
+	int mainOutput = findOutput(m, b.mainOutput);
+	m->outputs[mainOutput].channels = 1;
+
+	int pitchInput = findInput(m, b.pitchInput);
+	if (pitchInput >= 0) {
+		m->inputs[pitchInput].channels = channels;
+		for (int c = 0; c < channels; c++)
+			m->inputs[pitchInput].setVoltage(c * 7.f / 12.f - 1.f, c);
+	}
+	int gateInput = b.gateInput.empty() ? -1 : findInput(m, b.gateInput);
+	if (gateInput >= 0)
+		m->inputs[gateInput].channels = channels;
+
+	Module::ProcessArgs args;
+	args.sampleRate = sampleRate;
+	args.sampleTime = 1.f / sampleRate;
+	args.frame = 0;
+
+	// Gates toggle every quarter second, staggered across channels
+	int64_t gateLength = sampleRate / 4;
+	auto step = [&](int64_t i) {
+		if (gateInput >= 0 && i % 64 == 0) {
+			for (int c = 0; c < channels; c++)
+				m->inputs[gateInput].setVoltage(((i + c * gateLength / channels) / gateLength) % 2 ? 0.f : 10.f, c);
+		}
+		args.frame = i;
+		m->process(args);
+		sink = sink + m->outputs[mainOutput].getVoltage();
+	};
+
+	// Warm up caches and control-rate state before timing
+	timeNs(sampleRate / 10, step);
+
+	int64_t frames = seconds * sampleRate;
+	double ns = timeNs(frames, step);
+	std::string name = string::f("%s %gk %2dch %s", b.model->slug.c_str(), sampleRate / 1000.f, channels, allOutputs ? "all outputs" : "main output");
+	if (!b.settings.empty())
+		name += " " + b.settings;
+	printResult(name, ns, frames, sampleRate);
+
+	delete m;
+}
+
+
+// The building blocks in dspcore.hpp, timed on their own over one group of four voices
+static void benchComponents(float sampleRate, double seconds) {
+	int64_t frames = seconds * sampleRate;
+	float sampleTime = 1.f / sampleRate;
+
+	{
+		BasicOscillator<float_4> osc;
+		osc.freq = float_4(110.f, 220.f, 440.f, 880.f);
+		printResult("BasicOscillator x4 naive", timeNs(frames, [&](int64_t) {
+			osc.updatePhase(sampleTime);
+			sink = sink + (osc.triangle() + osc.saw() + osc.square())[0];
+		}), frames, sampleRate);
+		printResult("BasicOscillator x4 PolyBLEP", timeNs(frames, [&](int64_t) {
+			osc.updatePhase(sampleTime);
+			sink = sink + (osc.triangleBlep() + osc.sawBlep() + osc.squareBlep())[0];
+		}), frames, sampleRate);
+		printResult("BasicOscillator x4 minBLEP", timeNs(frames, [&](int64_t) {
+			osc.updatePhaseMinBlep(sampleTime);
+			sink = sink + (osc.triangleBlep() + osc.sawMinBlepOut() + osc.squareMinBlepOut())[0];
+		}), frames, sampleRate);
+	}
+
+	{
+		ADSREnvelope env;
+		env.setParams(0.01f, 0.1f, 0.5f, 0.2f, sampleTime);
+		int64_t gateLength = sampleRate / 4;
+		printResult("ADSREnvelope x4", timeNs(frames, [&](int64_t i) {
+			float_4 gate = ((i / gateLength) % 2) ? float_4::zero() : float_4::mask();
+			env.process(gate);
+			sink = sink + env.output[0];
+		}), frames, sampleRate);
+	}
+
+	{
+		SVFilter<float_4> filter;
+		filter.setParams(float_4(200.f, 800.f, 3200.f, 12800.f), 0.5f, sampleTime, 1);
+		printResult("SVFilter x4 12 dB", timeNs(frames, [&](int64_t i) {
+			filter.process((i & 64) ? 1.f : -1.f);
+			sink = sink + filter.output[0];
+		}), frames, sampleRate);
+		filter.fourPole = true;
+		printResult("SVFilter x4 24 dB", timeNs(frames, [&](int64_t i) {
+			filter.process((i & 64) ? 1.f : -1.f);
+			sink = sink + filter.output[0];
+		}), frames, sampleRate);
+	}
+
+	{
+		// Low enough that every partial stays below Nyquist
+		float envelope[8] = {1.f, 1.f, 1.f, 1.f, 1.f, 1.f, 1.f, 1.f};
+		for (int partials : {32, 64, 128}) {
+			AdditiveBank bank;
+			bank.setSpectrum(partials, 55.f, sampleTime, 1.f, 0.f, 0.f, envelope);
+			printResult(string::f("AdditiveBank %d partials", partials), timeNs(frames, [&](int64_t i) {
+				if (i % 32 == 0)
+					bank.renormalize();
+				sink = sink + bank.process();
+			}), frames, sampleRate);
+		}
+	}
+}
+
+
+// Drives a module's inputs and params before each frame
+typedef std::function<void(int64_t frame)> Driver;
+
+struct Scenario {
+	std::string name;
+	Model* model;
+	// Module settings as JSON, or empty for the defaults
+	std::string settings;
+	// Recorded outputs. Every channel of each is written, frame by frame.
+	std::vector<std::string> outputs;
+	// Patches the module and returns its driver
+	std::function<Driver(Module* m)> patch;
+};
+
+static const float scenarioSampleRate = 48000.f;
+static const int64_t scenarioFrames = 48000;
+
+static std::vector<Scenario> getScenarios() {
+	// Linear sweep from a to b volts over the scenario
+	auto sweep = [](int64_t frame, float a, float b) {
+		return a + (b - a) * frame / scenarioFrames;
+	};
+
+	return {
+		{"simplesine-sweep", modelSimpleSine, "", {"Sine"}, [=](Module* m) -> Driver {
+			int pitch = findInput(m, "1V/Octave pitch");
+			m->inputs[pitch].channels = 2;
+			return [=](int64_t i) {
+				m->inputs[pitch].setVoltage(sweep(i, -2.f, 3.f), 0);
+				m->inputs[pitch].setVoltage(sweep(i, 1.f, -1.f), 1);
+			};
+		}},
+
+		{"harm-osc-states", modelHarm_osc, "", {"Audio"}, [=](Module* m) -> Driver {
+			for (int k = 0; k < 8; k++)
+				m->params[k].setValue(1.f / (k + 1));
+			int pitch = findInput(m, "V/Oct");
+			int state = findParam(m, "Harmonic State");
+			m->inputs[pitch].channels = 1;
+			return [=](int64_t i) {
+				m->inputs[pitch].setVoltage(sweep(i, -1.f, 1.f));
+				m->params[state].setValue(1 + 3 * i / scenarioFrames);
+			};
+		}},
+
+		{"harm-osc-additive", modelHarm_osc, "", {"Audio"}, [=](Module* m) -> Driver {
+			for (int k = 0; k < 8; k++)
+				m->params[k].setValue(1.f - k / 8.f);
+			m->params[findParam(m, "Partials")].setValue(3.f);
+			m->params[findParam(m, "Partial stretch")].setValue(0.2f);
+			int pitch = findInput(m, "V/Oct");
+			int tilt = findParam(m, "Spectral tilt");
+			int oddEven = findParam(m, "Odd/even balance");
+			m->inputs[pitch].channels = 1;
+			return [=](int64_t i) {
+				m->inputs[pitch].setVoltage(sweep(i, -2.f, 2.f));
+				m->params[tilt].setValue(sweep(i, 0.5f, 1.5f));
+				m->params[oddEven].setValue(sweep(i, -1.f, 1.f));
+			};
+		}},
+
+		{"sub_osc-gates", modelSub_osc, "", {"Output", "Envelope"}, [=](Module* m) -> Driver {
+			m->params[findParam(m, "Attack Time")].setValue(0.01f);
+			m->params[findParam(m, "Decay Time")].setValue(0.05f);
+			m->params[findParam(m, "Release Time")].setValue(0.1f);
+			int pitch = findInput(m, "V/Oct");
+			int gate = findInput(m, "Gate");
+			m->inputs[pitch].channels = 4;
+			m->inputs[gate].channels = 4;
+			for (int c = 0; c < 4; c++)
+				m->inputs[pitch].setVoltage(c * 4.f / 12.f - 1.f, c);
+			return [=](int64_t i) {
+				// Each voice gates at its own rate
+				for (int c = 0; c < 4; c++)
+					m->inputs[gate].setVoltage((i / (2400 * (c + 1))) % 2 ? 0.f : 10.f, c);
+			};
+		}},
+
+		{"sub_osc-idle", modelSub_osc, "", {"Output"}, [=](Module* m) -> Driver {
+			m->params[findParam(m, "Release Time")].setValue(0.05f);
+			int pitch = findInput(m, "V/Oct");
+			int gate = findInput(m, "Gate");
+			m->inputs[pitch].channels = 16;
+			m->inputs[gate].channels = 16;
+			for (int c = 0; c < 16; c++)
+				m->inputs[pitch].setVoltage(c * 2.f / 12.f - 1.f, c);
+			return [=](int64_t i) {
+				// The first four voices hold a chord. The rest each play one
+				// short note per second and leave their groups silent otherwise.
+				for (int c = 0; c < 16; c++)
+					m->inputs[gate].setVoltage(c < 4 || (i + c * 2400) % 48000 < 4800 ? 10.f : 0.f, c);
+			};
+		}},
+
+		{"sub_osc-pwm", modelSub_osc, "", {"Output", "Osc 1 Square"}, [=](Module* m) -> Driver {
+			m->params[findParam(m, "Osc 1 PWM Amount")].setValue(1.f);
+			int pitch = findInput(m, "V/Oct");
+			int gate = findInput(m, "Gate");
+			int pwm = findInput(m, "Osc 1 PWM CV");
+			m->inputs[pitch].channels = 1;
+			m->inputs[gate].channels = 1;
+			m->inputs[gate].setVoltage(10.f);
+			m->inputs[pwm].channels = 1;
+			return [=](int64_t i) {
+				m->inputs[pitch].setVoltage(sweep(i, -1.f, 2.f));
+				m->inputs[pwm].setVoltage(5.f * std::sin(2 * M_PI * 3.f * i / scenarioSampleRate));
+			};
+		}},
+
+		{"sub_osc-filter", modelSub_osc, "{\"quality\": 2, \"oversample\": 2}", {"Output"}, [=](Module* m) -> Driver {
+			m->params[findParam(m, "Filter Resonance")].setValue(0.7f);
+			int gate = findInput(m, "Gate");
+			int cutoff = findInput(m, "Filter Cutoff CV");
+			int mode = findParam(m, "Filter Mode");
+			int slope = findParam(m, "Filter Slope");
+			m->inputs[findInput(m, "V/Oct")].channels = 1;
+			m->inputs[gate].channels = 1;
+			m->inputs[gate].setVoltage(10.f);
+			m->inputs[cutoff].channels = 1;
+			return [=](int64_t i) {
+				m->inputs[cutoff].setVoltage(sweep(i, -3.f, 3.f));
+				m->params[mode].setValue((6 * i / scenarioFrames) % 3);
+				m->params[slope].setValue(i < scenarioFrames / 2 ? 0.f : 1.f);
+			};
+		}},
+
+		{"sub_osc-unison", modelSub_osc, "{\"unison\": 8}", {"Output", "Output Right", "Osc 1 Saw"}, [=](Module* m) -> Driver {
+			int pitch = findInput(m, "V/Oct");
+			int gate = findInput(m, "Gate");
+			int detune = findParam(m, "Unison Detune");
+			int spread = findParam(m, "Unison Stereo Spread");
+			m->inputs[pitch].channels = 1;
+			m->inputs[gate].channels = 1;
+			m->inputs[gate].setVoltage(10.f);
+			return [=](int64_t i) {
+				m->inputs[pitch].setVoltage(sweep(i, -1.f, 1.f));
+				m->params[detune].setValue(sweep(i, 5.f, 50.f));
+				// The stereo split starts a quarter of the way in
+				m->params[spread].setValue(std::max(sweep(i, -0.5f, 1.5f), 0.f));
+			};
+		}},
+	};
+}
+
+// Renders a scenario into interleaved samples. Returns ns per frame.
+static double renderScenario(const Scenario& scenario, std::vector<float>& samples) {
+	Module* m = scenario.model->createModule();
+	if (!scenario.settings.empty()) {
+		json_t* settingsJ = json_loads(scenario.settings.c_str(), 0, NULL);
+		m->dataFromJson(settingsJ);
+		json_decref(settingsJ);
+	}
+
+	Module::SampleRateChangeEvent e;
+	e.sampleRate = scenarioSampleRate;
+	e.sampleTime = 1.f / scenarioSampleRate;
+	m->onSampleRateChange(e);
+
+	std::vector<int> outputs;
+	for (const std::string& name : scenario.outputs) {
+		int output = findOutput(m, name);
+		m->outputs[output].channels = 1;
+		outputs.push_back(output);
+	}
+	Driver drive = scenario.patch(m);
+
+	Module::ProcessArgs args;
+	args.sampleRate = scenarioSampleRate;
+	args.sampleTime = 1.f / scenarioSampleRate;
+
+	samples.clear();
+	double ns = timeNs(scenarioFrames, [&](int64_t i) {
+		drive(i);
+		args.frame = i;
+		m->process(args);
+		for (int output : outputs) {
+			for (int c = 0; c < m->outputs[output].getChannels(); c++)
+				samples.push_back(m->outputs[output].getVoltage(c));
+		}
+	});
+
+	delete m;
+	return ns / scenarioFrames;
+}
+
+static bool writeSamples(const std::string& path, const std::vector<float>& samples) {
+	FILE* f = std::fopen(path.c_str(), "wb");
+	if (!f)
+		return false;
+	std::fwrite(samples.data(), sizeof(float), samples.size(), f);
+	std::fclose(f);
+	return true;
+}
+
+static bool readSamples(const std::string& path, std::vector<float>& samples) {
+	FILE* f = std::fopen(path.c_str(), "rb");
+	if (!f)
+		return false;
+	samples.clear();
+	float buffer[1024];
+	size_t n;
+	while ((n = std::fread(buffer, sizeof(float), 1024, f)) > 0)
+		samples.insert(samples.end(), buffer, buffer + n);
+	std::fclose(f);
+	return true;
+}
+
+// Time budgets in ns per sample for each module's scenarios at 48 kHz. They
+// leave about three times the time a current desktop CPU takes, so only a
+// real regression trips them.
+static const std::map<std::string, double> defaultBudgets = {
+	{"simplesine", 500.0},
+	{"harm-osc", 1200.0},
+	{"sub_osc", 3000.0},
+};
+
+// A summary keeps, for each block of SUMMARY_BLOCK samples, the block's
+// minimum, maximum and RMS. The extremes catch clicks and the RMS catches
+// changes of level or timbre. No sample is kept as it is: a sweep's phase
+// drifts by different rounding under different compiler flags, and that
+// moves single samples by far more than it moves these.
+static const int SUMMARY_BLOCK = 256;
+
+static std::vector<float> summarize(const std::vector<float>& samples) {
+	std::vector<float> summary;
+	for (size_t start = 0; start < samples.size(); start += SUMMARY_BLOCK) {
+		size_t end = std::min(samples.size(), start + SUMMARY_BLOCK);
+		float low = samples[start];
+		float high = samples[start];
+		double power = 0.0;
+		for (size_t i = start; i < end; i++) {
+			low = std::min(low, samples[i]);
+			high = std::max(high, samples[i]);
+			power += (double) samples[i] * samples[i];
+		}
+		summary.push_back(low);
+		summary.push_back(high);
+		summary.push_back(std::sqrt(power / (end - start)));
+	}
+	return summary;
+}
+
+static int renderScenarios(const std::string& dir, bool summary) {
+	std::vector<float> samples;
+	for (const Scenario& scenario : getScenarios()) {
+		double ns = renderScenario(scenario, samples);
+		std::string path = dir + "/" + scenario.name + (summary ? ".sum" : ".raw");
+		if (!writeSamples(path, summary ? summarize(samples) : samples)) {
+			std::fprintf(stderr, "Could not write %s\n", path.c_str());
+			return 1;
+		}
+		std::printf("%-24s %8zu samples %10.1f ns/sample\n", scenario.name.c_str(), samples.size(), ns);
+	}
+	return 0;
+}
+
+static int compareScenarios(const std::string& dir, float tolerance, const std::map<std::string, double>& budgets) {
+	int failures = 0;
+	std::vector<float> samples;
+	std::vector<float> golden;
+	for (const Scenario& scenario : getScenarios()) {
+		double ns = renderScenario(scenario, samples);
+		std::string path = dir + "/" + scenario.name;
+		std::string status = "ok";
+
+		// Against a summary, compare summaries
+		if (!readSamples(path + ".raw", golden)) {
+			if (readSamples(path + ".sum", golden))
+				samples = summarize(samples);
+			else
+				status = "missing reference";
+		}
+		if (status == "ok" && golden.size() != samples.size())
+			status = string::f("length %zu, expected %zu", samples.size(), golden.size());
+
+		float maxError = 0.f;
+		if (status == "ok") {
+			for (size_t i = 0; i < samples.size(); i++)
+				maxError = std::max(maxError, std::fabs(samples[i] - golden[i]));
+			if (!(maxError <= tolerance))
+				status = "output changed";
+		}
+
+		auto budget = budgets.find(scenario.model->slug);
+		if (status == "ok" && budget != budgets.end() && budget->second > 0.0 && ns > budget->second)
+			status = string::f("over budget of %g ns/sample", budget->second);
+
+		if (status != "ok")
+			failures++;
+		std::printf("%-24s max error %10.3g V %10.1f ns/sample  %s\n", scenario.name.c_str(), maxError, ns, status.c_str());
+	}
+	std::printf("%d scenario(s) failed\n", failures);
+	return failures > 0 ? 1 : 0;
+}
+
+
+int main(int argc, char* argv[]) {
+	std::string command = (argc > 1) ? argv[1] : "";
+	if (command == "render" && argc > 2)
+		return renderScenarios(argv[2], argc > 3 && std::string(argv[3]) == "--summary");
+
+	if (command == "compare" && argc > 2) {
+		float tolerance = 1e-4f;
+		std::map<std::string, double> budgets = defaultBudgets;
+		for (int i = 3; i < argc; i++) {
+			std::string arg = argv[i];
+			size_t equals = arg.find('=');
+			if (arg == "--tolerance" && i + 1 < argc)
+				tolerance = std::atof(argv[++i]);
+			else if (equals != std::string::npos)
+				budgets[arg.substr(0, equals)] = std::atof(arg.c_str() + equals + 1);
+		}
+		return compareScenarios(argv[2], tolerance, budgets);
+	}
+
+	// Seconds of audio rendered per configuration
+	double seconds = (argc > 1) ? std::atof(argv[1]) : 2.0;
+
+	std::printf("Components\n");
+	benchComponents(48000.f, seconds);
+
+	std::vector<ModuleBench> benches = {
+		{modelSimpleSine, "1V/Octave pitch", "", "Sine", ""},
+		{modelHarm_osc, "V/Oct", "", "Audio", ""},
+		{modelHarm_osc, "V/Oct", "", "Audio", "{\"oversample\": 4}"},
+		{modelHarm_osc, "V/Oct", "", "Audio", "{\"oversample\": 4, \"rendered\": true}"},
+		{modelSub_osc, "V/Oct", "Gate", "Output", ""},
+		{modelSub_osc, "V/Oct", "Gate", "Output", "{\"oversample\": 4}"},
+		{modelSub_osc, "V/Oct", "Gate", "Output", "{\"unison\": 8}"},
+	};
+	for (const ModuleBench& b : benches) {
+		std::printf("\n%s %s\n", b.model->slug.c_str(), b.settings.c_str());
+		for (float sampleRate : {44100.f, 48000.f, 96000.f}) {
+			for (int channels : {1, 16}) {
+				for (bool allOutputs : {false, true}) {
+					benchModule(b, sampleRate, channels, allOutputs, seconds);
+				}
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,497 @@
+// Offline batch renderer for the plugin's modules. Build with `make render`.
+//
+//     render [-j THREADS] [-o DIR] FILE...
+//
+// Each FILE is an event file describing one job: a module, its settings and a
+// timeline of note, param and input events. The job is rendered as fast as the
+// CPU allows and written next to the event file, or into DIR, as a 32-bit
+// float WAV with the event file's name. Jobs run in parallel, each worker
+// thread taking the next job with its own module instance, so throughput scales
+// with cores. THREADS defaults to the number of hardware threads.
+//
+// As in the benchmark, modules are created through their Model without a
+// ModuleWidget and process() is called directly, so nothing here needs Rack's
+// engine or window. Modules that load or render wavetables on background
+// threads do that work inline here instead (see OfflineModule), so a job
+// renders the same output on every run.
+//
+// An event file has one directive or event per line. # starts a comment and
+// names with spaces are quoted.
+//
+//     module sub_osc                   model slug, required
+//     settings {"unison": 8}           module settings as saved in a patch
+//     rate 48000                       sample rate, 48000 by default
+//     length 4                         seconds to render, required
+//     out "Output" "Output Right"      outputs, one WAV channel each
+//     set "Filter Cutoff" 2000         param value before the first frame
+//     set 0 1                          params are named, or given by index
+//
+//     0     note 0 -1                  pitch input channel 0 to -1 V, gate high
+//     0.5   note 1 0.25
+//     2     off 0                      gate channel 0 low
+//     2.5   pitch 1 0.5                pitch input channel 1 to 0.5 V
+//     1     param "Unison Detune" 40   param value
+//     1     input "AMP CV" 0 -2        any input channel, in volts
+//
+// Times are in seconds. A polyphonic output is summed into its WAV channel, and
+// volts are scaled by 1/10 as Rack's audio interface does. Inputs are patched
+// with as many channels as their events address. Modules without a gate input
+// ignore the gate half of note and off.
+#include "../src/plugin.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <thread>
+#if defined ARCH_X64
+#include <xmmintrin.h>
+#endif
+
+
+typedef std::chrono::steady_clock Clock;
+
+// The modules this renderer knows, with the inputs note events drive
+struct ModuleInfo {
+	Model* model;
+	std::string pitchInput;
+	// Empty for modules that play continuously
+	std::string gateInput;
+};
+
+static std::vector<ModuleInfo> getModules() {
+	return {
+		{modelSimpleSine, "1V/Octave pitch", ""},
+		{modelHarm_osc, "V/Oct", ""},
+		{modelSub_osc, "V/Oct", "Gate"},
+	};
+}
+
+
+struct Event {
+	enum Type {
+		PARAM,
+		INPUT
+	};
+	double time;
+	Type type;
+	// Param or input name
+	std::string name;
+	int channel;
+	float value;
+	// Line in the event file, for errors found once the module exists
+	int line;
+};
+
+struct Job {
+	std::string path;
+	std::string wavPath;
+	ModuleInfo module;
+	std::string settings;
+	float sampleRate = 48000.f;
+	double length = 0.0;
+	std::vector<std::string> outputs;
+	// Directives and events in file order. set directives are events at time 0.
+	std::vector<Event> events;
+};
+
+struct JobResult {
+	std::string error;
+	int64_t frames = 0;
+	double seconds = 0.0;
+};
+
+
+// Splits a line into words. Double quotes group words with spaces into one.
+static std::vector<std::string> splitWords(const std::string& line) {
+	std::vector<std::string> words;
+	size_t i = 0;
+	while (i < line.size()) {
+		if (std::isspace((unsigned char) line[i])) {
+			i++;
+			continue;
+		}
+		std::string word;
+		if (line[i] == '"') {
+			size_t end = line.find('"', i + 1);
+			if (end == std::string::npos)
+				end = line.size();
+			word = line.substr(i + 1, end - i - 1);
+			i = end + 1;
+		}
+		else {
+			while (i < line.size() && !std::isspace((unsigned char) line[i]))
+				word += line[i++];
+		}
+		words.push_back(word);
+	}
+	return words;
+}
+
+static bool parseNumber(const std::string& word, double* value) {
+	char* end;
+	*value = std::strtod(word.c_str(), &end);
+	return !word.empty() && *end == '\0';
+}
+
+// Reads an event file into a job. Returns an error message, or "" on success.
+static std::string parseJob(const std::string& path, Job& job) {
+	std::ifstream file(path);
+	if (!file)
+		return "could not open file";
+
+	job.path = path;
+	std::string line;
+	for (int lineNumber = 1; std::getline(file, line); lineNumber++) {
+		size_t comment = line.find('#');
+		if (comment != std::string::npos)
+			line.erase(comment);
+		std::vector<std::string> words = splitWords(line);
+		if (words.empty())
+			continue;
+		std::string where = string::f("line %d: ", lineNumber);
+
+		double time;
+		if (!parseNumber(words[0], &time)) {
+			// Directive
+			const std::string& directive = words[0];
+			double value;
+			if (directive == "module" && words.size() == 2) {
+				bool found = false;
+				for (const ModuleInfo& module : getModules()) {
+					if (module.model->slug == words[1]) {
+						job.module = module;
+						found = true;
+					}
+				}
+				if (!found)
+					return where + "unknown module " + words[1];
+			}
+			else if (directive == "settings" && words.size() >= 2) {
+				// The rest of the line is JSON, quotes and all
+				job.settings = line.substr(line.find("settings") + 8);
+			}
+			else if (directive == "rate" && words.size() == 2 && parseNumber(words[1], &value) && value > 0.0) {
+				job.sampleRate = value;
+			}
+			else if (directive == "length" && words.size() == 2 && parseNumber(words[1], &value) && value > 0.0) {
+				job.length = value;
+			}
+			else if (directive == "out" && words.size() >= 2) {
+				job.outputs.insert(job.outputs.end(), words.begin() + 1, words.end());
+			}
+			else if (directive == "set" && words.size() == 3 && parseNumber(words[2], &value)) {
+				job.events.push_back({0.0, Event::PARAM, words[1], 0, (float) value, lineNumber});
+			}
+			else {
+				return where + "bad directive";
+			}
+			continue;
+		}
+
+		// Event. note and pitch need the module to know which input to drive.
+		if (!job.module.model)
+			return where + "events must follow the module directive";
+		if (words.size() < 2 || time < 0.0)
+			return where + "bad event";
+		const std::string& type = words[1];
+		double channel = 0.0;
+		double value = 0.0;
+		bool ok = true;
+		if (type == "note" && words.size() == 4) {
+			ok = parseNumber(words[2], &channel) && parseNumber(words[3], &value);
+			job.events.push_back({time, Event::INPUT, job.module.pitchInput, (int) channel, (float) value, lineNumber});
+			if (!job.module.gateInput.empty())
+				job.events.push_back({time, Event::INPUT, job.module.gateInput, (int) channel, 10.f, lineNumber});
+		}
+		else if (type == "off" && words.size() == 3) {
+			ok = parseNumber(words[2], &channel);
+			if (!job.module.gateInput.empty())
+				job.events.push_back({time, Event::INPUT, job.module.gateInput, (int) channel, 0.f, lineNumber});
+		}
+		else if (type == "pitch" && words.size() == 4) {
+			ok = parseNumber(words[2], &channel) && parseNumber(words[3], &value);
+			job.events.push_back({time, Event::INPUT, job.module.pitchInput, (int) channel, (float) value, lineNumber});
+		}
+		else if (type == "param" && words.size() == 4) {
+			ok = parseNumber(words[3], &value);
+			job.events.push_back({time, Event::PARAM, words[2], 0, (float) value, lineNumber});
+		}
+		else if (type == "input" && words.size() == 5) {
+			ok = parseNumber(words[3], &channel) && parseNumber(words[4], &value);
+			job.events.push_back({time, Event::INPUT, words[2], (int) channel, (float) value, lineNumber});
+		}
+		else {
+			ok = false;
+		}
+		if (!ok || channel < 0.0 || channel >= PORT_MAX_CHANNELS)
+			return where + "bad event";
+	}
+
+	if (!job.module.model)
+		return "no module directive";
+	if (job.length <= 0.0)
+		return "no length directive";
+	if (job.outputs.empty())
+		return "no out directive";
+
+	// Events at the same time keep their file order
+	std::stable_sort(job.events.begin(), job.events.end(), [](const Event& a, const Event& b) {
+		return a.time < b.time;
+	});
+	return "";
+}
+
+
+// Some params have no name, so a param can also be given by its index
+static int findParam(Module* m, const std::string& name) {
+	for (size_t i = 0; i < m->paramQuantities.size(); i++) {
+		if (m->paramQuantities[i]->name == name)
+			return i;
+	}
+	double index;
+	if (parseNumber(name, &index) && index == (int) index && index >= 0 && index < m->params.size())
+		return index;
+	return -1;
+}
+
+static int findInput(Module* m, const std::string& name) {
+	for (size_t i = 0; i < m->inputInfos.size(); i++) {
+		if (m->inputInfos[i]->name == name)
+			return i;
+	}
+	return -1;
+}
+
+static int findOutput(Module* m, const std::string& name) {
+	for (size_t i = 0; i < m->outputInfos.size(); i++) {
+		if (m->outputInfos[i]->name == name)
+			return i;
+	}
+	return -1;
+}
+
+
+static void writeLE(FILE* f, uint32_t value, int bytes) {
+	for (int i = 0; i < bytes; i++)
+		std::fputc((value >> (8 * i)) & 0xFF, f);
+}
+
+// Writes interleaved samples as a 32-bit float WAV file
+static bool writeWav(const std::string& path, const std::vector<float>& samples, int channels, int sampleRate) {
+	FILE* f = std::fopen(path.c_str(), "wb");
+	if (!f)
+		return false;
+
+	uint32_t dataSize = samples.size() * sizeof(float);
+	std::fwrite("RIFF", 1, 4, f);
+	writeLE(f, 36 + dataSize, 4);
+	std::fwrite("WAVE", 1, 4, f);
+
+	std::fwrite("fmt ", 1, 4, f);
+	writeLE(f, 16, 4);
+	// WAVE_FORMAT_IEEE_FLOAT
+	writeLE(f, 3, 2);
+	writeLE(f, channels, 2);
+	writeLE(f, sampleRate, 4);
+	writeLE(f, sampleRate * channels * sizeof(float), 4);
+	writeLE(f, channels * sizeof(float), 2);
+	writeLE(f, 32, 2);
+
+	std::fwrite("data", 1, 4, f);
+	writeLE(f, dataSize, 4);
+	for (float sample : samples) {
+		uint32_t bits;
+		std::memcpy(&bits, &sample, 4);
+		writeLE(f, bits, 4);
+	}
+
+	bool ok = !std::ferror(f);
+	std::fclose(f);
+	return ok;
+}
+
+
+// A parsed event, resolved to the module's ports and params
+struct Action {
+	int64_t frame;
+	Event::Type type;
+	int index;
+	int channel;
+	float value;
+};
+
+static JobResult renderJob(const Job& job) {
+	JobResult result;
+	Module* m = job.module.model->createModule();
+	// Load wavetables and render tables inline, so a job renders the same
+	// every time
+	OfflineModule* offline = dynamic_cast<OfflineModule*>(m);
+	if (offline)
+		offline->setOffline(true);
+	if (!job.settings.empty()) {
+		json_error_t error;
+		json_t* settingsJ = json_loads(job.settings.c_str(), 0, &error);
+		if (!settingsJ) {
+			result.error = string::f("bad settings: %s", error.text);
+			delete m;
+			return result;
+		}
+		m->dataFromJson(settingsJ);
+		json_decref(settingsJ);
+	}
+
+	Module::SampleRateChangeEvent e;
+	e.sampleRate = job.sampleRate;
+	e.sampleTime = 1.f / job.sampleRate;
+	m->onSampleRateChange(e);
+
+	// Resolve names, and patch each input with as many channels as it is given
+	std::vector<Action> actions;
+	for (const Event& event : job.events) {
+		int index = (event.type == Event::PARAM) ? findParam(m, event.name) : findInput(m, event.name);
+		if (index < 0) {
+			result.error = string::f("line %d: unknown %s \"%s\"", event.line, event.type == Event::PARAM ? "param" : "input", event.name.c_str());
+			delete m;
+			return result;
+		}
+		if (event.type == Event::INPUT)
+			m->inputs[index].channels = std::max<int>(m->inputs[index].channels, event.channel + 1);
+		actions.push_back({(int64_t) std::round(event.time * job.sampleRate), event.type, index, event.channel, event.value});
+	}
+
+	// Connecting a cable gives a port at least one channel
+	std::vector<int> outputs;
+	for (const std::string& name : job.outputs) {
+		int output = findOutput(m, name);
+		if (output < 0) {
+			result.error = string::f("unknown output \"%s\"", name.c_str());
+			delete m;
+			return result;
+		}
+		m->outputs[output].channels = 1;
+		outputs.push_back(output);
+	}
+
+	Module::ProcessArgs args;
+	args.sampleRate = job.sampleRate;
+	args.sampleTime = 1.f / job.sampleRate;
+
+	int64_t frames = job.length * job.sampleRate;
+	std::vector<float> samples(frames * outputs.size());
+	size_t next = 0;
+	Clock::time_point start = Clock::now();
+	for (int64_t i = 0; i < frames; i++) {
+		for (; next < actions.size() && actions[next].frame <= i; next++) {
+			const Action& action = actions[next];
+			if (action.type == Event::PARAM)
+				m->params[action.index].setValue(action.value);
+			else
+				m->inputs[action.index].setVoltage(action.value, action.channel);
+		}
+
+		args.frame = i;
+		m->process(args);
+
+		float* frame = &samples[i * outputs.size()];
+		for (size_t k = 0; k < outputs.size(); k++) {
+			Output& output = m->outputs[outputs[k]];
+			float sum = 0.f;
+			for (int c = 0; c < output.getChannels(); c++)
+				sum += output.getVoltage(c);
+			frame[k] = sum * 0.1f;
+		}
+	}
+	result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	result.frames = frames;
+	delete m;
+
+	if (!writeWav(job.wavPath, samples, outputs.size(), job.sampleRate))
+		result.error = "could not write " + job.wavPath;
+	return result;
+}
+
+
+int main(int argc, char* argv[]) {
+	int threads = std::max(1u, std::thread::hardware_concurrency());
+	std::string outputDir;
+	std::vector<std::string> paths;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "-j" && i + 1 < argc)
+			threads = std::max(1, std::atoi(argv[++i]));
+		else if (arg == "-o" && i + 1 < argc)
+			outputDir = argv[++i];
+		else
+			paths.push_back(arg);
+	}
+	if (paths.empty()) {
+		std::fprintf(stderr, "Usage: render [-j THREADS] [-o DIR] FILE...\n");
+		return 2;
+	}
+
+	std::vector<Job> jobs;
+	int failures = 0;
+	for (const std::string& path : paths) {
+		Job job;
+		std::string error = parseJob(path, job);
+		if (!error.empty()) {
+			std::fprintf(stderr, "%s: %s\n", path.c_str(), error.c_str());
+			failures++;
+			continue;
+		}
+		std::string dir = outputDir.empty() ? system::getDirectory(path) : outputDir;
+		job.wavPath = system::join(dir, system::getStem(path) + ".wav");
+		jobs.push_back(job);
+	}
+
+	threads = std::min<int>(threads, jobs.size());
+	std::vector<JobResult> results(jobs.size());
+	std::atomic<size_t> nextJob{0};
+	Clock::time_point start = Clock::now();
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threads; t++) {
+		workers.emplace_back([&]() {
+#if defined ARCH_X64
+			// Flush denormals to zero, as Rack's engine threads do
+			_mm_setcsr(_mm_getcsr() | 0x8040);
+#endif
+			for (size_t j; (j = nextJob++) < jobs.size();) {
+				results[j] = renderJob(jobs[j]);
+				const JobResult& result = results[j];
+				if (result.error.empty()) {
+					double audioSeconds = result.frames / jobs[j].sampleRate;
+					std::printf("%-40s %8.2f s %10.1fx realtime\n", jobs[j].wavPath.c_str(), audioSeconds, audioSeconds / result.seconds);
+				}
+				else {
+					std::fprintf(stderr, "%s: %s\n", jobs[j].path.c_str(), result.error.c_str());
+				}
+			}
+		});
+	}
+	for (std::thread& worker : workers)
+		worker.join();
+	double wallSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+	// Realtime multiples across all jobs: per core from the time each job took,
+	// and overall from the wall clock
+	int rendered = 0;
+	double audioSeconds = 0.0;
+	double renderSeconds = 0.0;
+	for (size_t j = 0; j < jobs.size(); j++) {
+		if (!results[j].error.empty()) {
+			failures++;
+			continue;
+		}
+		rendered++;
+		audioSeconds += results[j].frames / jobs[j].sampleRate;
+		renderSeconds += results[j].seconds;
+	}
+	if (renderSeconds > 0.0) {
+		std::printf("%d job(s), %.1f s of audio on %d thread(s) in %.2f s: %.1fx realtime per thread, %.1fx overall\n",
+			rendered, audioSeconds, threads, wallSeconds, audioSeconds / renderSeconds, audioSeconds / wallSeconds);
+	}
+	return failures > 0 ? 1 : 0;
+}
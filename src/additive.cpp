@@ -0,0 +1,173 @@
+#include "additive.hpp"
+
+
+// log2(n) for partial numbers 1 to MAX_PARTIALS
+static const float* getPartialLog2() {
+	static float table[AdditiveBank::MAX_PARTIALS];
+	static bool initialized = [] {
+		for (int n = 1; n <= AdditiveBank::MAX_PARTIALS; n++)
+			table[n - 1] = std::log2((float) n);
+		return true;
+	}();
+	(void) initialized;
+	return table;
+}
+
+
+AdditiveBank::AdditiveBank() {
+	reset();
+}
+
+
+void AdditiveBank::reset() {
+	for (int g = 0; g < MAX_GROUPS; g++) {
+		re[g] = 1.f;
+		im[g] = 0.f;
+		rotCos[g] = 1.f;
+		rotSin[g] = 0.f;
+		amp[g] = 0.f;
+		increment[g] = 0.f;
+	}
+	rampRemaining = 0;
+	chirping = false;
+	activeGroups = 0;
+	targetGroups = 0;
+}
+
+
+void AdditiveBank::setSpectrum(int numPartials, float freq, float sampleTime, float tilt, float oddEven, float stretch, const float* envelope, int rampSamples) {
+	const float* partialLog2 = getPartialLog2();
+	numPartials = clamp(numPartials, 4, MAX_PARTIALS);
+	int groups = (numPartials + 3) / 4;
+
+	float exponent = 1.f + 0.5f * stretch;
+	float oddGain = std::min(1.f, 1.f - oddEven);
+	float evenGain = std::min(1.f, 1.f + oddEven);
+	// Partial numbers in each group run odd, even, odd, even
+	float_4 parityGain = float_4(oddGain, evenGain, oddGain, evenGain);
+	float envelopeScale = 7.f / std::max(numPartials - 1, 1);
+	float baseIncrement = freq * sampleTime;
+
+	float_4 ampSum = 0.f;
+	// New increments, moved into increment[] once the ramp is set up
+	float_4 newIncrement[MAX_GROUPS];
+	targetGroups = 0;
+	for (int g = 0; g < groups; g++) {
+		float_4 log2n = float_4::load(&partialLog2[4 * g]);
+		float_4 increment = baseIncrement * fastmath::exp2(exponent * log2n);
+		newIncrement[g] = increment;
+
+		// Spectral envelope from the 8 gains, linearly interpolated
+		float_4 n = float_4(4 * g, 4 * g + 1, 4 * g + 2, 4 * g + 3);
+		float_4 pos = simd::fmin(n * envelopeScale, 7.f);
+		float_4 posFloor = simd::floor(pos);
+		float_4 frac = pos - posFloor;
+		float_4 env0, env1;
+		for (int i = 0; i < 4; i++) {
+			int index = (int) posFloor[i];
+			env0[i] = envelope[index];
+			env1[i] = envelope[std::min(index + 1, 7)];
+		}
+		float_4 a = env0 + frac * (env1 - env0);
+
+		a *= fastmath::exp2(-tilt * log2n);
+		a *= parityGain;
+		// Fade partials out as they approach Nyquist, and drop those past the end
+		a *= simd::clamp((0.48f - increment) / 0.08f, 0.f, 1.f);
+		a = simd::ifelse(n < float(numPartials), a, 0.f);
+		ampTarget[g] = a;
+		ampSum += a;
+
+		if (simd::movemask(increment < 0.48f))
+			targetGroups = g + 1;
+
+		targetCos[g] = fastmath::cos2pi(increment);
+		targetSin[g] = fastmath::sin2pi(increment);
+	}
+	// The fundamental is kept whatever the odd/even balance
+	float fundamental = envelope[0] * clamp((0.48f - baseIncrement) / 0.08f, 0.f, 1.f);
+	ampSum[0] += fundamental - ampTarget[0][0];
+	ampTarget[0][0] = fundamental;
+
+	// Normalize so the peak never exceeds 1
+	float total = ampSum[0] + ampSum[1] + ampSum[2] + ampSum[3];
+	float norm = (total > 1e-6f) ? 1.f / total : 0.f;
+	for (int g = 0; g < targetGroups; g++)
+		ampTarget[g] *= norm;
+	// Groups past the new end fade out
+	for (int g = targetGroups; g < MAX_GROUPS; g++)
+		ampTarget[g] = 0.f;
+
+	if (rampSamples <= 0) {
+		for (int g = 0; g < MAX_GROUPS; g++) {
+			amp[g] = ampTarget[g];
+			if (g < targetGroups) {
+				rotCos[g] = targetCos[g];
+				rotSin[g] = targetSin[g];
+				increment[g] = newIncrement[g];
+			}
+		}
+		activeGroups = targetGroups;
+		rampRemaining = 0;
+		return;
+	}
+
+	float rampScale = 1.f / rampSamples;
+	int rampGroups = std::max(activeGroups, targetGroups);
+	chirping = false;
+	for (int g = 0; g < rampGroups; g++) {
+		ampStep[g] = (ampTarget[g] - amp[g]) * rampScale;
+		// Groups that were silent jump straight to their new pitch
+		if (g >= activeGroups) {
+			rotCos[g] = targetCos[g];
+			rotSin[g] = targetSin[g];
+			increment[g] = newIncrement[g];
+		}
+		// Fading groups keep their pitch
+		if (g >= targetGroups) {
+			targetCos[g] = rotCos[g];
+			targetSin[g] = rotSin[g];
+			newIncrement[g] = increment[g];
+		}
+		float_4 incrementStep = (newIncrement[g] - increment[g]) * rampScale;
+		if (simd::movemask(incrementStep != 0.f))
+			chirping = true;
+		chirpCos[g] = fastmath::cos2pi(incrementStep);
+		chirpSin[g] = fastmath::sin2pi(incrementStep);
+		increment[g] = newIncrement[g];
+	}
+	activeGroups = rampGroups;
+	rampRemaining = rampSamples;
+}
+
+
+float AdditiveBank::processRamp() {
+	float_4 sum = 0.f;
+	for (int g = 0; g < activeGroups; g++) {
+		float_4 r = re[g] * rotCos[g] - im[g] * rotSin[g];
+		float_4 i = re[g] * rotSin[g] + im[g] * rotCos[g];
+		re[g] = r;
+		im[g] = i;
+		sum += amp[g] * i;
+		amp[g] += ampStep[g];
+	}
+	if (chirping) {
+		for (int g = 0; g < activeGroups; g++) {
+			float_4 c = rotCos[g] * chirpCos[g] - rotSin[g] * chirpSin[g];
+			float_4 s = rotCos[g] * chirpSin[g] + rotSin[g] * chirpCos[g];
+			rotCos[g] = c;
+			rotSin[g] = s;
+		}
+	}
+
+	// Land exactly on the target, free of the steps' rounding
+	if (--rampRemaining == 0) {
+		for (int g = 0; g < activeGroups; g++) {
+			amp[g] = ampTarget[g];
+			rotCos[g] = targetCos[g];
+			rotSin[g] = targetSin[g];
+		}
+		activeGroups = targetGroups;
+	}
+	return sum[0] + sum[1] + sum[2] + sum[3];
+}
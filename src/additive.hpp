@@ -0,0 +1,89 @@
+#pragma once
+#include "plugin.hpp"
+#include "fastmath.hpp"
+
+using simd::float_4;
+
+
+// Bank of sine partials generated by complex rotation. Each partial keeps a
+// unit phasor that is multiplied by its per-sample rotation, so a partial
+// costs four multiplies and two adds per sample, with no table or polynomial.
+// Partials are stored four to a float_4, and only groups with a partial below
+// Nyquist are processed, so cost grows linearly with the audible partials.
+// A new spectrum can be reached over a ramp, with amplitudes and frequencies
+// moving linearly each sample, so control-rate updates do not zipper.
+struct AdditiveBank {
+	static const int MAX_PARTIALS = 128;
+	static const int MAX_GROUPS = MAX_PARTIALS / 4;
+
+	// Phasor of each partial. The imaginary part is the partial's sine.
+	float_4 re[MAX_GROUPS];
+	float_4 im[MAX_GROUPS];
+	// Per-sample rotation of each partial
+	float_4 rotCos[MAX_GROUPS];
+	float_4 rotSin[MAX_GROUPS];
+	float_4 amp[MAX_GROUPS];
+	// Phase increment of each partial, in cycles per sample
+	float_4 increment[MAX_GROUPS];
+
+	// While ramping, each sample adds ampStep to amp and turns the rotation by
+	// the chirp rotation, which moves the increment by a fixed step. The ramp
+	// ends exactly on the target rotation and amplitude.
+	float_4 ampStep[MAX_GROUPS];
+	float_4 ampTarget[MAX_GROUPS];
+	float_4 chirpCos[MAX_GROUPS];
+	float_4 chirpSin[MAX_GROUPS];
+	float_4 targetCos[MAX_GROUPS];
+	float_4 targetSin[MAX_GROUPS];
+	int rampRemaining = 0;
+	// Whether the ramp changes any increment, or only amplitudes
+	bool chirping = false;
+
+	// Number of leading groups with at least one partial below Nyquist. While
+	// ramping it also covers the groups that are fading out.
+	int activeGroups = 0;
+	int targetGroups = 0;
+
+	AdditiveBank();
+	void reset();
+
+	/** Sets the partial count and shape. Call when pitch or controls change.
+	 * freq is the fundamental in Hz.
+	 * tilt sets partial n to 1/n^tilt, whatever the stretch.
+	 * oddEven runs from -1 (odd partials only) to 1 (even partials and the fundamental).
+	 * stretch runs from -1 to 1 and warps ratio n to n^(1 + stretch / 2).
+	 * envelope is 8 gains spread evenly across the partials and interpolated between.
+	 * rampSamples is how many process() calls the bank takes to reach the new
+	 * spectrum. 0 jumps to it at once. Pass the update interval, so each ramp
+	 * ends as the next begins.
+	 */
+	void setSpectrum(int numPartials, float freq, float sampleTime, float tilt, float oddEven, float stretch, const float* envelope, int rampSamples = 0);
+
+	/** Corrects the phasor magnitudes, which drift with rounding. Calling it
+	 * every few dozen samples is enough. */
+	void renormalize() {
+		for (int g = 0; g < activeGroups; g++) {
+			float_4 mag2 = re[g] * re[g] + im[g] * im[g];
+			// One Newton step towards 1 / sqrt(mag2), which is close to 1
+			float_4 k = 1.5f - 0.5f * mag2;
+			re[g] *= k;
+			im[g] *= k;
+		}
+	}
+
+	float process() {
+		if (rampRemaining > 0)
+			return processRamp();
+		float_4 sum = 0.f;
+		for (int g = 0; g < activeGroups; g++) {
+			float_4 r = re[g] * rotCos[g] - im[g] * rotSin[g];
+			float_4 i = re[g] * rotSin[g] + im[g] * rotCos[g];
+			re[g] = r;
+			im[g] = i;
+			sum += amp[g] * i;
+		}
+		return sum[0] + sum[1] + sum[2] + sum[3];
+	}
+
+	float processRamp();
+};
@@ -0,0 +1,386 @@
+#pragma once
+#include "plugin.hpp"
+#include "fastmath.hpp"
+#include "phase.hpp"
+
+using simd::float_4;
+
+
+// Oscillator, envelope and filter building blocks. They are kept out of the
+// module sources so the benchmark can drive them without a Module around them.
+
+// PolyBLEP residual for a downward step of 2 at phase 0. t is the phase and
+// dt the phase increment per sample.
+template <typename T>
+T polyBlep(T t, T dt) {
+    T x = t / dt;
+    T y = (t - 1.f) / dt;
+    T after = -(1.f - x) * (1.f - x);
+    T before = (1.f + y) * (1.f + y);
+    return simd::ifelse(t < dt, after, simd::ifelse(t > 1.f - dt, before, T(0.f)));
+}
+
+// PolyBLAMP residual for a unit change of slope per sample at phase 0
+template <typename T>
+T polyBlamp(T t, T dt) {
+    T x = simd::fmin(t, 1.f - t) / dt;
+    T r = simd::fmax(1.f - x, 0.f);
+    return r * r * r * (1.f / 6.f);
+}
+
+// Step residual for MinBlepBuffer, built once per size and shared by every
+// buffer. dsp::MinBlepGenerator computes its own copy in its constructor,
+// which adds up across Sub_osc's unison copies.
+template <int Z, int O>
+const float* getMinBlepImpulse() {
+    struct Impulse {
+        float samples[2 * Z * O + 1];
+        Impulse() {
+            dsp::minBlepImpulse(Z, O, samples);
+            samples[2 * Z * O] = 1.f;
+        }
+    };
+    static const Impulse impulse;
+    return impulse.samples;
+}
+
+// dsp::MinBlepGenerator without the per-instance impulse table
+template <int Z, int O, typename T = float>
+struct MinBlepBuffer {
+    T buf[2 * Z] = {};
+    int pos = 0;
+    const float* impulse = getMinBlepImpulse<Z, O>();
+    
+    // p is the discontinuity's position in samples, in (-1, 0]
+    void insertDiscontinuity(float p, T x) {
+        if (!(-1.f < p && p <= 0.f))
+            return;
+        for (int j = 0; j < 2 * Z; j++) {
+            float minBlepIndex = ((float) j - p) * O;
+            int index = (int) minBlepIndex;
+            float lambda = minBlepIndex - index;
+            float minBlepValue = crossfade(impulse[index], impulse[index + 1], lambda);
+            buf[(pos + j) % (2 * Z)] += x * (-1.f + minBlepValue);
+        }
+    }
+    
+    T process() {
+        T v = buf[pos];
+        buf[pos] = T(0.f);
+        pos = (pos + 1) % (2 * Z);
+        return v;
+    }
+};
+
+// Simple oscillator class. T is float for a single oscillator or float_4 for
+// four polyphonic voices at once.
+template <typename T = float>
+struct BasicOscillator {
+    // Fixed-point phase, and its value in cycles for the waveform code below
+    PhaseAccumulator<T> accumulator;
+    T phase = 0.f;
+    T freq = 0.f;
+    T pw = 0.5f;
+    T deltaPhase = 0.f;
+    
+    // Residual generators for the minBLEP waveforms
+    MinBlepBuffer<16, 16, T> sawMinBlep;
+    MinBlepBuffer<16, 16, T> sqrMinBlep;
+    
+    void updatePhase(float deltaTime) {
+        deltaPhase = freq * deltaTime;
+        accumulator.setIncrement(deltaPhase);
+        accumulator.step();
+        phase = accumulator.get();
+    }
+    
+    // Advances the phase by several samples at once, for a voice nobody hears
+    void skipPhase(float deltaTime, int samples) {
+        accumulator.setIncrement(freq * (deltaTime * samples));
+        accumulator.step();
+        phase = accumulator.get();
+    }
+    
+    // Same as updatePhase(), but also inserts minBLEPs for the saw and square
+    // steps crossed during this sample. Only used with T = float_4.
+    void updatePhaseMinBlep(float deltaTime) {
+        T oldPhase = phase;
+        deltaPhase = freq * deltaTime;
+        accumulator.setIncrement(deltaPhase);
+        accumulator.step();
+        phase = accumulator.get();
+        
+        // Fraction of the sample at which each step was crossed. The wrap is
+        // taken from the accumulator itself so it can never be missed.
+        T wrapCrossing = simd::clamp((1.f - oldPhase) / deltaPhase, 1e-6f, 1.f);
+        T pwCrossing = (pw - oldPhase) / deltaPhase;
+        int wrapMask = simd::movemask(phase < oldPhase);
+        int pwMask = simd::movemask((pwCrossing > 0.f) & (pwCrossing <= 1.f));
+        
+        for (int i = 0; i < T::size; i++) {
+            if (!((wrapMask | pwMask) & (1 << i)))
+                continue;
+            T mask = simd::movemaskInverse<T>(1 << i);
+            if (wrapMask & (1 << i)) {
+                float p = wrapCrossing[i] - 1.f;
+                sawMinBlep.insertDiscontinuity(p, mask & T(-2.f));
+                sqrMinBlep.insertDiscontinuity(p, mask & T(2.f));
+            }
+            if (pwMask & (1 << i)) {
+                float p = pwCrossing[i] - 1.f;
+                sqrMinBlep.insertDiscontinuity(p, mask & T(-2.f));
+            }
+        }
+    }
+    
+    T sine() {
+        return fastmath::sin2pi(phase);
+    }
+    
+    T triangle() {
+        return simd::ifelse(phase < 0.5f, 4.f * phase - 1.f, 3.f - 4.f * phase);
+    }
+    
+    T saw() {
+        return 2.f * phase - 1.f;
+    }
+    
+    T square() {
+        return simd::ifelse(phase < pw, T(1.f), T(-1.f));
+    }
+    
+    // Band-limited waveforms. Call after updatePhase().
+    T blepDeltaPhase() {
+        return simd::clamp(deltaPhase, 1e-6f, 0.5f);
+    }
+    
+    T triangleBlep() {
+        T dt = blepDeltaPhase();
+        // The slope changes by 8 per cycle at each corner
+        T halfPhase = simd::ifelse(phase < 0.5f, phase + 0.5f, phase - 0.5f);
+        return triangle() + 8.f * dt * (polyBlamp(phase, dt) - polyBlamp(halfPhase, dt));
+    }
+    
+    T sawBlep() {
+        return saw() - polyBlep(phase, blepDeltaPhase());
+    }
+    
+    T squareBlep() {
+        T dt = blepDeltaPhase();
+        T pwPhase = phase - pw;
+        pwPhase -= simd::floor(pwPhase);
+        return square() + polyBlep(phase, dt) - polyBlep(pwPhase, dt);
+    }
+    
+    // Naive waveforms plus the pending minBLEP residuals. Call after
+    // updatePhaseMinBlep().
+    T sawMinBlepOut() {
+        return saw() + sawMinBlep.process();
+    }
+    
+    T squareMinBlepOut() {
+        return square() + sqrMinBlep.process();
+    }
+};
+
+// Exponential ADSR envelope for a bank of four voices. Each segment is a
+// one-pole approach towards a target, so one multiply-add per sample advances
+// all four voices with no branches. The per-sample coefficients only change in
+// setParams(), and only when a time or the sample rate changed. Attack aims past
+// 1 so it reaches the peak in finite time, as an analog envelope does. Release
+// starts from wherever the output is when the gate falls.
+struct ADSREnvelope {
+    // Attack aims at ATTACK_TARGET and stops at 1. Release aims just below 0
+    // and stops at 0.
+    static constexpr float ATTACK_TARGET = 1.2f;
+    static constexpr float RELEASE_TARGET = -0.01f;
+    
+    float_4 output = 0.f;
+    float_4 attacking = float_4::zero();
+    float_4 gateWasHigh = float_4::zero();
+    
+    float sustainLevel = 0.5f;
+    float attackCoeff = 1.f;
+    float decayCoeff = 1.f;
+    float releaseCoeff = 1.f;
+    
+    // Inputs of the last coefficient update
+    float lastAttackTime = -1.f;
+    float lastDecayTime = -1.f;
+    float lastReleaseTime = -1.f;
+    float lastSampleTime = -1.f;
+    
+    // Fraction of the remaining distance covered each sample, for a segment
+    // that takes `time` seconds to cover the fraction `reach` of the distance to
+    // its target
+    static float segmentCoeff(float time, float reach, float sampleTime) {
+        float tau = time / -std::log(1.f - reach);
+        return 1.f - std::exp(-sampleTime / tau);
+    }
+    
+    void setParams(float attackTime, float decayTime, float sustain, float releaseTime, float sampleTime) {
+        sustainLevel = sustain;
+        if (sampleTime != lastSampleTime || attackTime != lastAttackTime)
+            attackCoeff = segmentCoeff(attackTime, 1.f / ATTACK_TARGET, sampleTime);
+        // Decay covers 99% of the way to the sustain level in decayTime
+        if (sampleTime != lastSampleTime || decayTime != lastDecayTime)
+            decayCoeff = segmentCoeff(decayTime, 0.99f, sampleTime);
+        if (sampleTime != lastSampleTime || releaseTime != lastReleaseTime)
+            releaseCoeff = segmentCoeff(releaseTime, 1.f / (1.f - RELEASE_TARGET), sampleTime);
+        lastAttackTime = attackTime;
+        lastDecayTime = decayTime;
+        lastReleaseTime = releaseTime;
+        lastSampleTime = sampleTime;
+    }
+    
+    void process(float_4 gate) {
+        // A rising gate (re)starts the attack from the current level, and a
+        // falling gate ends it
+        float_4 rising = ~gateWasHigh & gate;
+        attacking = (attacking | rising) & gate;
+        gateWasHigh = gate;
+        
+        float_4 target = simd::ifelse(attacking, float_4(ATTACK_TARGET), simd::ifelse(gate, float_4(sustainLevel), float_4(RELEASE_TARGET)));
+        float_4 coeff = simd::ifelse(attacking, float_4(attackCoeff), simd::ifelse(gate, float_4(decayCoeff), float_4(releaseCoeff)));
+        output += (target - output) * coeff;
+        
+        // Attack hands over to decay at the peak
+        attacking = attacking & (output < 1.f);
+        output = simd::clamp(output, 0.f, 1.f);
+    }
+    
+    // Lanes that have fully released
+    float_4 isIdle() {
+        return ~gateWasHigh & (output <= 0.f);
+    }
+};
+
+// True if any lane is set. Lets templated code test float and float_4 masks alike.
+inline bool anyTrue(bool x) {
+    return x;
+}
+
+inline bool anyTrue(float_4 x) {
+    return simd::movemask(x) != 0;
+}
+
+// Sum of the four lanes
+inline float sumLanes(float_4 x) {
+    return x[0] + x[1] + x[2] + x[3];
+}
+
+// Zero-delay-feedback state-variable filter (Zavalishin's topology-preserving
+// transform) with lowpass, bandpass and highpass responses. The 24 dB slope
+// cascades two 12 dB stages that share coefficients. setParams() recomputes the
+// coefficients only when the cutoff, resonance or sample rate changed. The new
+// values are then ramped in linearly, so process() has no divisions.
+template <typename T = float>
+struct SVFilter {
+    enum Mode {
+        LOWPASS_MODE,
+        BANDPASS_MODE,
+        HIGHPASS_MODE,
+        MODES_LEN
+    };
+    
+    int mode = LOWPASS_MODE;
+    bool fourPole = false;
+    T output = 0.f;
+    
+    // Integrator states of the two stages
+    T ic1eq[2] = {};
+    T ic2eq[2] = {};
+    
+    // Current coefficients, their targets and their per-sample ramp
+    T k = 2.f, a1 = 0.f, a2 = 0.f, a3 = 0.f;
+    T kTarget = 2.f, a1Target = 0.f, a2Target = 0.f, a3Target = 0.f;
+    T kStep = 0.f, a1Step = 0.f, a2Step = 0.f, a3Step = 0.f;
+    
+    // Inputs of the last coefficient update
+    T lastCutoff = 0.f;
+    float lastResonance = -1.f;
+    float lastSampleTime = 0.f;
+    
+    // cutoff in Hz, resonance in [0, 1]. The new coefficients are reached after
+    // rampLength calls to process().
+    void setParams(T cutoff, float resonance, float sampleTime, int rampLength) {
+        bool first = (lastSampleTime == 0.f);
+        if (!first && !anyTrue(cutoff != lastCutoff) && resonance == lastResonance && sampleTime == lastSampleTime) {
+            // Nothing changed, so finish any ramp that is still running
+            k = kTarget;
+            a1 = a1Target;
+            a2 = a2Target;
+            a3 = a3Target;
+            kStep = a1Step = a2Step = a3Step = 0.f;
+            return;
+        }
+        lastCutoff = cutoff;
+        lastResonance = resonance;
+        lastSampleTime = sampleTime;
+        
+        // Warp the cutoff, keeping it clear of Nyquist. Q runs from 0.5 to 16.
+        T g = fastmath::tanPi(simd::fmin(cutoff * sampleTime, T(0.45f)));
+        kTarget = 2.f * fastmath::exp2(-5.f * resonance);
+        a1Target = 1.f / (1.f + g * (g + kTarget));
+        a2Target = g * a1Target;
+        a3Target = g * a2Target;
+        
+        if (first || rampLength <= 1) {
+            k = kTarget;
+            a1 = a1Target;
+            a2 = a2Target;
+            a3 = a3Target;
+            kStep = a1Step = a2Step = a3Step = 0.f;
+            return;
+        }
+        float rampScale = 1.f / rampLength;
+        kStep = (kTarget - k) * rampScale;
+        a1Step = (a1Target - a1) * rampScale;
+        a2Step = (a2Target - a2) * rampScale;
+        a3Step = (a3Target - a3) * rampScale;
+    }
+    
+    // Clears the integrators and finishes any coefficient ramp
+    void reset() {
+        for (int s = 0; s < 2; s++) {
+            ic1eq[s] = 0.f;
+            ic2eq[s] = 0.f;
+        }
+        output = 0.f;
+        k = kTarget;
+        a1 = a1Target;
+        a2 = a2Target;
+        a3 = a3Target;
+        kStep = a1Step = a2Step = a3Step = 0.f;
+    }
+    
+    T processStage(int s, T v0) {
+        T v3 = v0 - ic2eq[s];
+        T v1 = a1 * ic1eq[s] + a2 * v3;
+        T v2 = ic2eq[s] + a2 * ic1eq[s] + a3 * v3;
+        ic1eq[s] = 2.f * v1 - ic1eq[s];
+        ic2eq[s] = 2.f * v2 - ic2eq[s];
+        
+        switch (mode) {
+            default:
+            case LOWPASS_MODE:
+                return v2;
+            case BANDPASS_MODE:
+                return v1;
+            case HIGHPASS_MODE:
+                return v0 - k * v1 - v2;
+        }
+    }
+    
+    void process(T input) {
+        k += kStep;
+        a1 += a1Step;
+        a2 += a2Step;
+        a3 += a3Step;
+        
+        T x = processStage(0, input);
+        if (fourPole)
+            x = processStage(1, x);
+        output = x;
+    }
+};
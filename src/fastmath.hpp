@@ -0,0 +1,138 @@
+#pragma once
+#include "plugin.hpp"
+
+
+// Polynomial and rational approximations of the libm functions used in the
+// audio path. Every function is a template that works on float and on
+// simd::float_4. Each has an accurate tier, good enough to replace the libm call
+// outright, and a Fast tier for modulation and other non-critical uses. The
+// error bounds below were measured against double-precision libm over the
+// stated domain.
+namespace fastmath {
+
+
+// 2^n for integer-valued n, built directly in the float exponent field
+inline float exp2Int(float n) {
+	int32_t bits = (int32_t) ((n + 127.f) * 8388608.f);
+	float y;
+	std::memcpy(&y, &bits, sizeof(y));
+	return y;
+}
+
+inline simd::float_4 exp2Int(simd::float_4 n) {
+	return simd::float_4::cast(simd::int32_4((n + 127.f) * 8388608.f));
+}
+
+
+/** 2^x with relative error < 1e-6 for |x| < 126. Degree-5 polynomial. */
+template <typename T>
+T exp2(T x) {
+	x = simd::fmax(simd::fmin(x, 126.f), -126.f);
+	T xi = simd::floor(x);
+	T f = x - xi;
+	T p = 0.0018775769f;
+	p = p * f + 0.0089893397f;
+	p = p * f + 0.0558263175f;
+	p = p * f + 0.2401536107f;
+	p = p * f + 0.6931530833f;
+	p = p * f + 0.9999999404f;
+	return p * exp2Int(xi);
+}
+
+/** 2^x with relative error < 8e-5 (0.13 cents) for |x| < 126. Degree-3 polynomial. */
+template <typename T>
+T exp2Fast(T x) {
+	x = simd::fmax(simd::fmin(x, 126.f), -126.f);
+	T xi = simd::floor(x);
+	T f = x - xi;
+	T p = 0.0780245438f;
+	p = p * f + 0.2260671407f;
+	p = p * f + 0.6958335638f;
+	p = p * f + 0.9999251962f;
+	return p * exp2Int(xi);
+}
+
+
+// Folds a phase in cycles into [-0.25, 0.25] and returns the sign to apply, so
+// the odd polynomials below only cover a quarter cycle
+template <typename T>
+T foldQuarterCycle(T phase) {
+	T x = phase - simd::floor(phase) - 0.5f;
+	x = simd::ifelse(x > 0.25f, 0.5f - x, x);
+	x = simd::ifelse(x < -0.25f, -0.5f - x, x);
+	// The half cycle offset flips the sign
+	return -x;
+}
+
+// sin(2 pi x) for |x| <= 0.25, the odd degree-7 polynomial behind sin2pi()
+template <typename T>
+T sin2piQuarter(T x) {
+	T x2 = x * x;
+	T p = -70.993423f;
+	p = p * x2 + 81.340767f;
+	p = p * x2 - 41.337143f;
+	p = p * x2 + 6.2831640f;
+	return p * x;
+}
+
+/** sin(2 pi phase) for any phase, absolute error < 1e-6. Odd degree-7 polynomial. */
+template <typename T>
+T sin2pi(T phase) {
+	return sin2piQuarter(foldQuarterCycle(phase));
+}
+
+/** sin(2 pi phase) for any phase, absolute error < 7e-5. Odd degree-5 polynomial. */
+template <typename T>
+T sin2piFast(T phase) {
+	T x = foldQuarterCycle(phase);
+	T x2 = x * x;
+	T p = 73.585495f;
+	p = p * x2 - 41.095242f;
+	p = p * x2 + 6.2812800f;
+	return p * x;
+}
+
+/** cos(2 pi phase), same bounds as sin2pi(). */
+template <typename T>
+T cos2pi(T phase) {
+	return sin2pi(phase + 0.25f);
+}
+
+/** cos(2 pi phase), same bounds as sin2piFast(). */
+template <typename T>
+T cos2piFast(T phase) {
+	return sin2piFast(phase + 0.25f);
+}
+
+/** tan(pi x) for |x| < 0.5 as the ratio of the sine and cosine polynomials.
+ * Relative error < 1e-5 for |x| <= 0.45.
+ */
+template <typename T>
+T tanPi(T x) {
+	// The half angle is already within a quarter cycle, so no folding is
+	// needed and small arguments keep their full precision
+	T half = 0.5f * x;
+	return sin2piQuarter(half) / sin2piQuarter(0.25f - simd::fmax(half, -half));
+}
+
+
+/** tanh(x) for any x, absolute error < 1e-4. [7/6] Padé approximant, clamped where it reaches 1. */
+template <typename T>
+T tanh(T x) {
+	x = simd::fmax(simd::fmin(x, 4.97f), -4.97f);
+	T x2 = x * x;
+	T num = x * (135135.f + x2 * (17325.f + x2 * (378.f + x2)));
+	T den = 135135.f + x2 * (62370.f + x2 * (3150.f + x2 * 28.f));
+	return num / den;
+}
+
+/** tanh(x) for any x, absolute error < 0.024. [3/2] Padé approximant, clamped at |x| = 3. */
+template <typename T>
+T tanhFast(T x) {
+	x = simd::fmax(simd::fmin(x, 3.f), -3.f);
+	T x2 = x * x;
+	return x * (27.f + x2) / (27.f + 9.f * x2);
+}
+
+
+} // namespace fastmath
@@ -1,7 +1,49 @@
 #include "plugin.hpp"
+#include "wavetable.hpp"
+#include "fastmath.hpp"
+#include "phase.hpp"
+#include "additive.hpp"
+#include "oversampling.hpp"
+#include "profiler.hpp"
+#include <osdialog.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+using simd::float_4;
+
+
+// Expander bus. A Harm_osc whose left neighbour is another Harm_osc becomes a
+// partial bank: its eight sliders play the next eight partials of the master
+// at the left end of the chain, which sets pitch, harmonic state and
+// oversampling for the whole chain. Each message lives in the receiver's
+// double-buffered expander slots, so it is written once and read in place.
+
+// Sent rightwards, from a Harm_osc to the bank on its right
+struct HarmBusDownMessage {
+	// False when the master is in its additive mode and banks should be silent
+	bool active;
+	// Position of the receiving bank, the master being 0
+	int bankIndex;
+	float pitch;
+	int state;
+	int oversample;
+};
+
+// Sent leftwards, from a bank to the Harm_osc on its left
+struct HarmBusUpMessage {
+	// Number of banks summed below, counting the sender
+	int banks;
+	int oversample;
+	// Partial sums of the sender and every bank to its right, one per
+	// oversampled step
+	float sums[Decimator<float>::MAX_FACTOR];
+};
 
 
-struct Harm_osc : Module {
+struct Harm_osc : Module, OfflineModule {
 	enum ParamId {
 		VCA1_PARAM,
 		VCA2_PARAM,
@@ -16,6 +58,11 @@ struct Harm_osc : Module {
 		REG_PARAM,
 		LOG_PARAM,
 		POW_PARAM,
+		PARTIALS_PARAM,
+		TILT_PARAM,
+		ODDEVEN_PARAM,
+		STRETCH_PARAM,
+		WAVE_PARAM,
 		PARAMS_LEN
 	};
 	enum InputId {
@@ -40,36 +87,147 @@ struct Harm_osc : Module {
 		SQT_LIGHT,
 		LIGHTS_LEN
 	};
+	enum ProfileId {
+		CONTROLS_PROFILE,
+		PARTIALS_PROFILE,
+		DECIMATOR_PROFILE,
+		PROFILES_LEN
+	};
 
-	float phase = 0.f;
-
-	#define NUM_WAVE_SAMPLES 1000
-
-	float sineWaveTable[NUM_WAVE_SAMPLES];
-
-	float harmonicLevels[8];
-	float harmonicPhases[8] = {0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f};
-
-	float stdHarmonicFrequencies[8] = {261.63, 523.28, 784.89, 1046.73, 1308.15, 1569.78, 1831.41, 2093.04 };
-	float logHarmonicFrequencies[8] = {261.63, 523.28, 905.24, 1046.73, 1469.38,  1810.5, 1993.92, 2094.88 };
-	float sqtHarmonicFrequencies[8] = {261.63, 523.28, 867.82, 1046.73, 1384.74, 1736.09, 1958.28, 2094.88 };
+	// Shared with every other instance
+	const SineTable& sineTable = getSineTable();
+
+	// A user wavetable replaces the sine when loaded, from a loader thread
+	WavetableExchange userTable;
+	const UserWavetable* wavetable = nullptr;
+	std::string wavetablePath;
+	std::thread loader;
+
+	// Rendered mode plays the sliders from one single-cycle table instead of
+	// summing partials. A worker thread renders it whenever the levels move,
+	// and the audio thread crossfades to each new table. Only integer partial
+	// ratios are periodic, so it applies in the first harmonic state alone.
+	static constexpr float RENDER_FADE_TIME = 0.02f;
+	enum RenderState {
+		RENDER_IDLE,
+		RENDER_REQUESTED,
+		RENDER_BUSY
+	};
+	bool rendered = false;
+	WavetableExchange renderedTable;
+	std::thread renderer;
+	std::atomic<bool> rendererRunning{false};
+	std::mutex renderMutex;
+	std::condition_variable renderCondition;
+	// The audio thread writes renderLevels only while the renderer is idle
+	std::atomic<int> renderState{RENDER_IDLE};
+	float renderLevels[8];
+	float_4 requestedLevels[2];
+	dsp::ClockDivider renderDivider;
+	// The table plays at the fundamental, at the engine rate
+	PhaseAccumulator<float> renderPhase;
+	int renderLevel = 0;
+	// 0 plays the summed partials and 1 the table
+	float renderMix = 0.f;
+	// Crossfade from renderedTable's previous table to the current one
+	float tableFade = 1.f;
+	// Offline, wavetables load and render on the calling thread (see
+	// OfflineModule)
+	bool offline = false;
+
+	// Partials 1-4 and 5-8 each occupy one float_4. Their increments are
+	// recomputed only when their inputs change.
+	PhaseAccumulator<float_4> harmonics[2];
+	// Each partial's wavetable mipmap level
+	simd::int32_4 mipLevels[2];
+
+	// Partial n's ratio to the fundamental, for each harmonic state:
+	// n, log2(n + 1) and sqrt(n). A bank holds partials 8 * bankIndex + 1 onwards.
+	float harmonicRatios[3][8];
+	int ratioBank = -1;
+
+	// Sample-rate-derived constants, rebuilt by onSampleRateChange()
+	float sampleTime = 1.f / 44100.f;
+	// Phase increment of C4 at the engine rate
+	float c4Increment = dsp::FREQ_C4 / 44100.f;
+	// Per-sample step of the render crossfades
+	float renderFadeStep = 1.f / (44100.f * RENDER_FADE_TIME);
+
+	// Each partial's increment at C4, for the current harmonic state, bank,
+	// oversampling factor and sample rate. A pitch change then costs one
+	// multiply per lane.
+	float_4 ratioIncrements[2];
+	int ratioState = -1;
+	int ratioFactor = 0;
+
+	float lastPitch = INFINITY;
+	// 5 V divided by the number of partials summed into the output
+	float outputGain = 5.f / 8;
+	int gainPartials = 8;
+
+	// Expander message buffers, for messages from the left and from the right
+	HarmBusDownMessage downMessages[2] = {};
+	HarmBusUpMessage upMessages[2] = {};
+
+	// High partial count mode, where the sliders shape a spectral envelope
+	AdditiveBank additive;
+	// The spectrum is rebuilt at this rate, which also sets how often pitch is read
+	dsp::ClockDivider spectrumDivider;
+	bool additiveActive = false;
+
+	// The eight partials are summed at this multiple of the engine rate
+	int oversample = 1;
+	Decimator<float> decimator;
+
+#ifdef ASTROKKIDD_PROFILE
+	// Indexed by ProfileId
+	Profiler profiler{{"Controls", "Partials", "Decimator"}};
+#endif
 
 	bool isReg = true;
 	bool isLog, isSqt = false;
 
-	float mapToTable(float phase) {
-		int tableIndex = (int)(phase * NUM_WAVE_SAMPLES);
-		tableIndex = tableIndex % NUM_WAVE_SAMPLES;
+	float_4 mapToTable(int k, int frame, float frameFrac) {
+		if (wavetable)
+			return 5.f * wavetable->lookupPhase(harmonics[k].phase, mipLevels[k], frame, frameFrac);
+		return 5.f * sineTable.lookupPhase(harmonics[k].phase);
+	}
 
-		return (sineWaveTable[tableIndex]);
+	void setRatioBank(int bank) {
+		for (int i = 0; i < 8; i++) {
+			float n = 8 * bank + i + 1;
+			harmonicRatios[0][i] = n;
+			harmonicRatios[1][i] = std::log2(n + 1.f);
+			harmonicRatios[2][i] = std::sqrt(n);
+		}
+		ratioBank = bank;
+		// Forces updateRatioIncrements()
+		ratioState = -1;
 	}
 
-	void initializeTable()
-	{
-		for (int i = 0; i < NUM_WAVE_SAMPLES; i++)
-		{
-			sineWaveTable[i] = 5.0f * std::sin(2.f * M_PI * ((float)i / NUM_WAVE_SAMPLES));
+	void updateRatioIncrements(int state, int factor) {
+		float subTime = sampleTime / factor;
+		for (int k = 0; k < 2; k++)
+			ratioIncrements[k] = float_4::load(&harmonicRatios[state][4 * k]) * (dsp::FREQ_C4 * subTime);
+		ratioState = state;
+		ratioFactor = factor;
+		// Forces updateIncrements()
+		lastPitch = INFINITY;
+	}
+
+	void updateIncrements(float pitch) {
+		// Ensure base frequency is within a reasonable range
+		float scale = clamp(fastmath::exp2(pitch), 10.f / dsp::FREQ_C4, 20000.f / dsp::FREQ_C4);
+		for (int k = 0; k < 2; k++) {
+			float_4 increment = ratioIncrements[k] * scale;
+			harmonics[k].setIncrement(increment);
+			for (int i = 0; i < 4; i++)
+				mipLevels[k][i] = UserWavetable::getMipLevel(increment[i]);
 		}
+		renderPhase.setIncrement(c4Increment * scale);
+		renderLevel = UserWavetable::getMipLevel(c4Increment * scale);
+
+		lastPitch = pitch;
 	}
 
 	Harm_osc() {
@@ -85,71 +243,403 @@ struct Harm_osc : Module {
 		configParam(VCA8_PARAM, 0.f, 1.f, 0.f, "");
 		configParam(FREQ_PARAM, -5.f, 5.f, 0.f, "Freq (1V/Oct)", " Hz", 2, dsp::FREQ_C4);
 		configSwitch(STATE_PARAM, 1.f, 3.f, 1.f, "Harmonic State");
+		configSwitch(PARTIALS_PARAM, 0.f, 3.f, 0.f, "Partials", {"8 (sliders)", "32", "64", "128"});
+		configParam(TILT_PARAM, 0.f, 2.f, 1.f, "Spectral tilt", " dB/oct", 0.f, -6.02f);
+		configParam(ODDEVEN_PARAM, -1.f, 1.f, 0.f, "Odd/even balance", "%", 0.f, 100.f);
+		configParam(STRETCH_PARAM, -1.f, 1.f, 0.f, "Partial stretch", "%", 0.f, 100.f);
+		configParam(WAVE_PARAM, 0.f, 1.f, 0.f, "Wavetable position", "%", 0.f, 100.f);
+
+		configInput(VOCT_INPUT, "V/Oct");
+		configInput(CV1_INPUT, "Partial 1 CV");
+		configInput(CV2_INPUT, "Partial 2 CV");
+		configInput(CV3_INPUT, "Partial 3 CV");
+		configInput(CV4_INPUT, "Partial 4 CV");
+		configInput(CV5_INPUT, "Partial 5 CV");
+		configInput(CV6_INPUT, "Partial 6 CV");
+		configInput(CV7_INPUT, "Partial 7 CV");
+		configInput(CV8_INPUT, "Partial 8 CV");
+		configOutput(OUT_OUTPUT, "Audio");
+
+		spectrumDivider.setDivision(32);
+		renderDivider.setDivision(64);
+		// Forces the first render
+		requestedLevels[0] = requestedLevels[1] = -1.f;
+		setRatioBank(0);
+
+		leftExpander.producerMessage = &downMessages[0];
+		leftExpander.consumerMessage = &downMessages[1];
+		rightExpander.producerMessage = &upMessages[0];
+		rightExpander.consumerMessage = &upMessages[1];
+	}
 
-		configInput(VOCT_INPUT, "");
-		configInput(CV1_INPUT, "");
-		configInput(CV2_INPUT, "");
-		configInput(CV3_INPUT, "");
-		configInput(CV4_INPUT, "");
-		configInput(CV5_INPUT, "");
-		configInput(CV6_INPUT, "");
-		configInput(CV7_INPUT, "");
-		configInput(CV8_INPUT, "");
-		configOutput(OUT_OUTPUT, "");
+	~Harm_osc() {
+		if (loader.joinable())
+			loader.join();
+		setRendered(false);
+	}
 
-		initializeTable();
+	bool isHarmOsc(Module* module) {
+		return module && module->model == modelHarm_osc;
 	}
 
-	void process(const ProcessArgs& args) override {
-    // Calculate the base frequency from parameters and inputs
-		float baseFreq = dsp::FREQ_C4 * std::pow(2.f, params[FREQ_PARAM].getValue() + inputs[VOCT_INPUT].getVoltage());
+	json_t* dataToJson() override {
+		json_t* rootJ = json_object();
+		json_object_set_new(rootJ, "oversample", json_integer(oversample));
+		if (!wavetablePath.empty())
+			json_object_set_new(rootJ, "wavetable", json_string(wavetablePath.c_str()));
+		json_object_set_new(rootJ, "rendered", json_boolean(rendered));
+		return rootJ;
+	}
 
-		// Ensure base frequency is within a reasonable range
-		baseFreq = clamp(baseFreq, 10.f, 20000.f);
+	void dataFromJson(json_t* rootJ) override {
+		json_t* oversampleJ = json_object_get(rootJ, "oversample");
+		if (oversampleJ)
+			setOversample(json_integer_value(oversampleJ));
+		json_t* wavetableJ = json_object_get(rootJ, "wavetable");
+		if (wavetableJ)
+			loadWavetable(json_string_value(wavetableJ));
+		json_t* renderedJ = json_object_get(rootJ, "rendered");
+		if (renderedJ)
+			setRendered(json_boolean_value(renderedJ));
+	}
 
-		float outputSignal = 0.f;
+	/** Starts loading a wavetable in the background. The sine plays on until it is ready. */
+	void loadWavetable(const std::string& path) {
+		// One load at a time. The previous one has nearly always finished.
+		if (loader.joinable())
+			loader.join();
+		wavetablePath = path;
+		auto load = [this, path]() {
+			std::string error;
+			std::shared_ptr<const UserWavetable> table = loadUserWavetable(path, &error);
+			if (table)
+				userTable.publish(table);
+			else
+				WARN("Could not load wavetable %s: %s", path.c_str(), error.c_str());
+		};
+		if (offline)
+			load();
+		else
+			loader = std::thread(load);
+	}
+
+	void unloadWavetable() {
+		if (loader.joinable())
+			loader.join();
+		wavetablePath = "";
+		userTable.publish(nullptr);
+	}
+
+	void setRendered(bool enable) {
+		if (enable == rendered)
+			return;
+		if (enable) {
+			// Offline, requestRender() renders each table itself
+			if (!offline) {
+				rendererRunning = true;
+				renderer = std::thread([this]() {
+					renderLoop();
+				});
+			}
+			rendered = true;
+		}
+		else {
+			rendered = false;
+			if (renderer.joinable()) {
+				{
+					std::lock_guard<std::mutex> lock(renderMutex);
+					rendererRunning = false;
+				}
+				renderCondition.notify_one();
+				renderer.join();
+			}
+		}
+	}
 
-		// Iterate over all harmonics
+	void setOffline(bool offline) override {
+		this->offline = offline;
+	}
+
+	// Sleeps until the audio thread requests a render. The audio thread
+	// notifies without taking the mutex so it never blocks, which can lose a
+	// wakeup that lands just before the wait. The timeout catches those.
+	void renderLoop() {
+		std::unique_lock<std::mutex> lock(renderMutex);
+		while (rendererRunning) {
+			int expected = RENDER_REQUESTED;
+			if (!renderState.compare_exchange_strong(expected, RENDER_BUSY, std::memory_order_acquire)) {
+				renderCondition.wait_for(lock, std::chrono::milliseconds(100));
+				continue;
+			}
+			lock.unlock();
+			renderedTable.publish(renderHarmonicWavetable(renderLevels, 8));
+			renderState.store(RENDER_IDLE, std::memory_order_release);
+			lock.lock();
+		}
+	}
+
+	// Called on the audio thread
+	void requestRender(const float_4* amplitudes) {
+		if (renderState.load(std::memory_order_acquire) != RENDER_IDLE)
+			return;
+		// Slider and CV noise below this is inaudible and would render nonstop
+		float_4 change = simd::fmax(simd::abs(amplitudes[0] - requestedLevels[0]), simd::abs(amplitudes[1] - requestedLevels[1]));
+		if (simd::movemask(change > 1e-3f) == 0)
+			return;
+		for (int k = 0; k < 2; k++) {
+			requestedLevels[k] = amplitudes[k];
+			requestedLevels[k].store(&renderLevels[4 * k]);
+		}
+		// Offline, the table is ready for the swap() that follows this call
+		if (offline) {
+			renderedTable.publish(renderHarmonicWavetable(renderLevels, 8));
+			return;
+		}
+		renderState.store(RENDER_REQUESTED, std::memory_order_release);
+		renderCondition.notify_one();
+	}
+
+	// The summed partials reach the output through the decimator, so the
+	// table runs this far behind them
+	uint32_t getRenderLag() {
+		return (uint32_t) (decimator.getDelay() * renderPhase.increment);
+	}
+
+	// Puts every partial in phase with the rendered table's fundamental
+	void syncPartials() {
+		uint32_t phase = renderPhase.phase + getRenderLag();
+		for (int k = 0; k < 2; k++) {
+			for (int i = 0; i < 4; i++)
+				harmonics[k].phase[i] = (uint32_t) (4 * k + i + 1) * phase;
+		}
+	}
+
+	float processRendered(float sum, bool playTable) {
+		renderPhase.step();
+		float out = renderedTable.get()->lookupPhase(renderPhase.phase, renderLevel);
+
+		const UserWavetable* previous = renderedTable.getPrevious();
+		if (previous) {
+			out = crossfade(previous->lookupPhase(renderPhase.phase, renderLevel), out, tableFade);
+			tableFade += renderFadeStep;
+			if (tableFade >= 1.f)
+				renderedTable.releasePrevious();
+		}
+
+		renderMix = playTable ? std::min(renderMix + renderFadeStep, 1.f) : std::max(renderMix - renderFadeStep, 0.f);
+		// The table holds unit sines, the summed partials are scaled like mapToTable()
+		return crossfade(sum, 5.f * out, renderMix);
+	}
+
+	void setOversample(int factor) {
+		// Only powers of two up to the decimator's limit
+		int f = 1;
+		while (f < factor && f < Decimator<float>::MAX_FACTOR)
+			f *= 2;
+		oversample = f;
+	}
+
+	void onSampleRateChange(const SampleRateChangeEvent& e) override {
+		sampleTime = e.sampleTime;
+		c4Increment = dsp::FREQ_C4 * sampleTime;
+		renderFadeStep = sampleTime / RENDER_FADE_TIME;
+		// Forces updateRatioIncrements()
+		ratioState = -1;
+	}
+
+	void getLevels(float* levels) {
 		for (int i = 0; i < 8; i++) {
-			// Calculate harmonic frequency as (i + 1) times the base frequency
-			float harmonicScale = 0.f;
-			float harmonicState = params[STATE_PARAM].getValue();
-
-			float harmonicFreq = 0.f;
-
-			if (harmonicState == 1.f) {
-				//harmonicScale = i + 1;
-				harmonicFreq = stdHarmonicFrequencies[i];
-			} else if (harmonicState == 2.f) {
-				//harmonicScale = std::log2(i + 2);
-				harmonicFreq = logHarmonicFrequencies[i];
-			} else if (harmonicState == 3.f) {
-				//harmonicScale = std::sqrt(i + 1);
-				harmonicFreq = sqtHarmonicFrequencies[i];
+			if (inputs[CV1_INPUT + i].isConnected())
+				levels[i] = clamp(inputs[CV1_INPUT + i].getVoltage() * 0.1f, 0.f, 1.f);
+			else
+				levels[i] = params[VCA1_PARAM + i].getValue();
+		}
+	}
+
+	void processAdditive(const ProcessArgs& args) {
+		static const int partialCounts[] = {32, 64, 128};
+
+		// Switching in from the slider mode rebuilds the spectrum immediately
+		if (spectrumDivider.process() || !additiveActive) {
+			PROFILE_SCOPE(CONTROLS_PROFILE);
+			float baseFreq = dsp::FREQ_C4 * fastmath::exp2(params[FREQ_PARAM].getValue() + inputs[VOCT_INPUT].getVoltage());
+			baseFreq = clamp(baseFreq, 10.f, 20000.f);
+
+			float envelope[8];
+			getLevels(envelope);
+
+			int partials = partialCounts[clamp((int) params[PARTIALS_PARAM].getValue() - 1, 0, 2)];
+			// Each update ramps in over the samples until the next one
+			int rampSamples = additiveActive ? spectrumDivider.getDivision() : 0;
+			additive.setSpectrum(partials, baseFreq, sampleTime,
+				params[TILT_PARAM].getValue(), params[ODDEVEN_PARAM].getValue(), params[STRETCH_PARAM].getValue(), envelope, rampSamples);
+			additive.renormalize();
+			additiveActive = true;
+		}
+
+		PROFILE_SCOPE(PARTIALS_PROFILE);
+		outputs[OUT_OUTPUT].setVoltage(5.f * additive.process());
+	}
+
+	void process(const ProcessArgs& args) override {
+		bool isBank = isHarmOsc(leftExpander.module);
+		bool hasBank = isHarmOsc(rightExpander.module);
+		const HarmBusDownMessage* fromLeft = (const HarmBusDownMessage*) leftExpander.consumerMessage;
+
+		if (!isBank && params[PARTIALS_PARAM].getValue() > 0.f) {
+			processAdditive(args);
+			if (hasBank) {
+				HarmBusDownMessage* toRight = (HarmBusDownMessage*) rightExpander.module->leftExpander.producerMessage;
+				toRight->active = false;
+				rightExpander.module->leftExpander.requestMessageFlip();
 			}
+			return;
+		}
+		additiveActive = false;
+
+		if (isBank && !fromLeft->active) {
+			outputs[OUT_OUTPUT].setVoltage(0.f);
+			if (hasBank) {
+				HarmBusDownMessage* toRight = (HarmBusDownMessage*) rightExpander.module->leftExpander.producerMessage;
+				toRight->active = false;
+				rightExpander.module->leftExpander.requestMessageFlip();
+			}
+			return;
+		}
 
-        	//float harmonicFreq = baseFreq * harmonicScale;
+		// A bank follows the master
+		int bankIndex = isBank ? fromLeft->bankIndex : 0;
+		float pitch = isBank ? fromLeft->pitch : params[FREQ_PARAM].getValue() + inputs[VOCT_INPUT].getVoltage();
+		int state = isBank ? fromLeft->state : clamp((int) params[STATE_PARAM].getValue() - 1, 0, 2);
+		int factor = isBank ? fromLeft->oversample : oversample;
+
+		if (hasBank) {
+			HarmBusDownMessage* toRight = (HarmBusDownMessage*) rightExpander.module->leftExpander.producerMessage;
+			toRight->active = true;
+			toRight->bankIndex = bankIndex + 1;
+			toRight->pitch = pitch;
+			toRight->state = state;
+			toRight->oversample = factor;
+			rightExpander.module->leftExpander.requestMessageFlip();
+		}
 
-			// Adjust harmonic phase based on the current sample time
-			harmonicPhases[i] += harmonicFreq * args.sampleTime;
-			if (harmonicPhases[i] >= 1.f) {
-				harmonicPhases[i] -= 1.f;
+		float_4 amplitudes[2];
+		int frame = 0;
+		float frameFrac = 0.f;
+		bool playTable;
+		{
+			PROFILE_SCOPE(CONTROLS_PROFILE);
+
+			if (userTable.swap()) {
+				userTable.releasePrevious();
+				wavetable = userTable.get();
+			}
+			if (wavetable) {
+				float position = params[WAVE_PARAM].getValue() * (wavetable->frames - 1);
+				frame = clamp((int) position, 0, wavetable->frames - 1);
+				frameFrac = position - frame;
+			}
+
+			// Track harmonic state, oversampling, sample rate and pitch
+			if (bankIndex != ratioBank)
+				setRatioBank(bankIndex);
+			if (state != ratioState || factor != ratioFactor)
+				updateRatioIncrements(state, factor);
+			if (pitch != lastPitch)
+				updateIncrements(pitch);
+
+			// Gather amplitudes from CV input or parameter, so the kernel below only
+			// sees contiguous arrays
+			float levels[8];
+			float cvs[8];
+			float connected[8];
+			for (int i = 0; i < 8; i++) {
+				levels[i] = params[VCA1_PARAM + i].getValue();
+				cvs[i] = inputs[CV1_INPUT + i].getVoltage();
+				connected[i] = inputs[CV1_INPUT + i].isConnected() ? 1.f : 0.f;
+			}
+
+			for (int k = 0; k < 2; k++) {
+				float_4 cvAmplitude = simd::clamp(float_4::load(&cvs[4 * k]) * 0.1f, 0.f, 1.f);
+				amplitudes[k] = simd::ifelse(float_4::load(&connected[4 * k]) > 0.f, cvAmplitude, float_4::load(&levels[4 * k]));
 			}
 
-			// Determine the amplitude of the harmonic from CV input or parameter
-			float amplitude = inputs[CV1_INPUT + i].isConnected()
-				? clamp(inputs[CV1_INPUT + i].getVoltage() * 0.1f, 0.f, 1.f)
-				: params[VCA1_PARAM + i].getValue();
+			bool renderable = rendered && !isBank && !hasBank && state == 0 && !wavetable;
+			if (renderable && renderDivider.process())
+				requestRender(amplitudes);
+			if (renderedTable.swap()) {
+				// Fade from the old table only if it is being heard
+				if (renderMix > 0.f)
+					tableFade = 0.f;
+				else
+					renderedTable.releasePrevious();
+			}
+
+			playTable = renderable && renderedTable.get();
+			// Start the table in phase with the fundamental, and leave it with
+			// every partial in phase with the table
+			if (playTable && renderMix == 0.f)
+				renderPhase.phase = (uint32_t) harmonics[0].phase[0] - getRenderLag();
+			if (!playTable && renderMix == 1.f)
+				syncPartials();
+		}
+
+		// Once the table has fully taken over, the partials are skipped
+		if (playTable && renderMix == 1.f) {
+			PROFILE_SCOPE(PARTIALS_PROFILE);
+			outputs[OUT_OUTPUT].setVoltage(5.f / 8 * processRendered(0.f, true));
+			return;
+		}
 
-			// Generate the harmonic signal using the phase and amplitude
-			float harmonicSignal = amplitude * mapToTable(harmonicPhases[i]);
+		float buffer[Decimator<float>::MAX_FACTOR];
+		{
+			PROFILE_SCOPE(PARTIALS_PROFILE);
+			for (int s = 0; s < factor; s++) {
+				float_4 outputSum = 0.f;
+
+				// Two lanes of four partials each
+				for (int k = 0; k < 2; k++) {
+					harmonics[k].step();
+
+					// Sum the harmonic signals into the total output signal
+					outputSum += amplitudes[k] * mapToTable(k, frame, frameFrac);
+				}
+				buffer[s] = outputSum[0] + outputSum[1] + outputSum[2] + outputSum[3];
+			}
+		}
 
-			// Sum the harmonic signal into the total output signal
-			outputSignal += harmonicSignal;
+		// Add the banks to the right, which arrive a sample late per bank
+		int banks = 1;
+		float chain[Decimator<float>::MAX_FACTOR];
+		const HarmBusUpMessage* fromRight = (const HarmBusUpMessage*) rightExpander.consumerMessage;
+		bool chainValid = hasBank && fromRight->oversample == factor;
+		for (int s = 0; s < factor; s++)
+			chain[s] = chainValid ? buffer[s] + fromRight->sums[s] : buffer[s];
+		if (chainValid)
+			banks += fromRight->banks;
+
+		if (isBank) {
+			HarmBusUpMessage* toLeft = (HarmBusUpMessage*) leftExpander.module->rightExpander.producerMessage;
+			toLeft->banks = banks;
+			toLeft->oversample = factor;
+			std::copy(chain, chain + factor, toLeft->sums);
+			leftExpander.module->rightExpander.requestMessageFlip();
 		}
 
+		PROFILE_SCOPE(DECIMATOR_PROFILE);
+		// The master plays the whole chain and a bank plays its own partials
+		decimator.setFactor(factor);
+		float outputSignal = decimator.process(isBank ? buffer : chain);
+		if (playTable || renderMix > 0.f)
+			outputSignal = processRendered(outputSignal, playTable);
+
 		// Set the final output voltage, scaled to a reasonable range
-		outputs[OUT_OUTPUT].setVoltage(5.f * outputSignal / 8.f);  // Normalize by number of harmonics
+		int partials = isBank ? 8 : 8 * banks;
+		if (partials != gainPartials) {
+			outputGain = 5.f / partials;
+			gainPartials = partials;
+		}
+		outputs[OUT_OUTPUT].setVoltage(outputGain * outputSignal);  // Normalize by number of harmonics
 	}
 };
 
@@ -175,6 +665,11 @@ struct Harm_oscWidget : ModuleWidget {
 		addParam(createParamCentered<RoundBlackKnob>(mm2px(Vec(13.0, 73.0)), module, Harm_osc::FREQ_PARAM));
 
 		addParam(createParamCentered<CKSSThree>(mm2px(Vec(13.0, 58.0)), module, Harm_osc::STATE_PARAM));
+		addParam(createParamCentered<RoundBlackKnob>(mm2px(Vec(13.0, 43.0)), module, Harm_osc::PARTIALS_PARAM));
+		addParam(createParamCentered<RoundBlackKnob>(mm2px(Vec(28.0, 43.0)), module, Harm_osc::TILT_PARAM));
+		addParam(createParamCentered<RoundBlackKnob>(mm2px(Vec(43.0, 43.0)), module, Harm_osc::ODDEVEN_PARAM));
+		addParam(createParamCentered<RoundBlackKnob>(mm2px(Vec(58.0, 43.0)), module, Harm_osc::STRETCH_PARAM));
+		addParam(createParamCentered<RoundBlackKnob>(mm2px(Vec(73.0, 43.0)), module, Harm_osc::WAVE_PARAM));
 		
 		//addParam(createLightParamCentered<VCVLightLatch<MediumSimpleLight<WhiteLight>>>(mm2px(Vec(13.0, 58.0)), module, Harm_osc::REG_PARAM, Harm_osc::REG_LIGHT));
 		//addParam(createLightParamCentered<VCVLightLatch<MediumSimpleLight<WhiteLight>>>(mm2px(Vec(13.0, 43.0)), module, Harm_osc::LOG_PARAM, Harm_osc::LOG_LIGHT));
@@ -215,6 +710,53 @@ struct Harm_oscWidget : ModuleWidget {
 		addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(133.0, 118.0)), module, Harmosc::OUT_OUTPUT));*/
 
 	}
+
+	void appendContextMenu(Menu* menu) override {
+		Harm_osc* module = getModule<Harm_osc>();
+
+		menu->addChild(new MenuSeparator);
+		menu->addChild(createIndexSubmenuItem("Oversampling (8 partials)", {"Off", "2x", "4x", "8x"},
+			[=]() {
+				return (size_t) std::log2(module->oversample);
+			},
+			[=](size_t index) {
+				module->setOversample(1 << index);
+			}
+		));
+
+		menu->addChild(new MenuSeparator);
+		menu->addChild(createMenuLabel("Wavetable (8 partials)"));
+		if (!module->wavetablePath.empty())
+			menu->addChild(createMenuLabel(system::getFilename(module->wavetablePath)));
+		menu->addChild(createMenuItem("Load WAV...", "", [=]() {
+			osdialog_filters* filters = osdialog_filters_parse("WAV:wav");
+			std::string dir = system::getDirectory(module->wavetablePath);
+			char* pathC = osdialog_file(OSDIALOG_OPEN, dir.empty() ? NULL : dir.c_str(), NULL, filters);
+			osdialog_filters_free(filters);
+			if (!pathC)
+				return;
+			module->loadWavetable(pathC);
+			std::free(pathC);
+		}));
+		if (!module->wavetablePath.empty())
+			menu->addChild(createMenuItem("Unload", "", [=]() {
+				module->unloadWavetable();
+			}));
+
+		menu->addChild(new MenuSeparator);
+		menu->addChild(createBoolMenuItem("Render static timbres", "sine, 1st state",
+			[=]() {
+				return module->rendered;
+			},
+			[=](bool rendered) {
+				module->setRendered(rendered);
+			}
+		));
+
+#ifdef ASTROKKIDD_PROFILE
+		module->profiler.appendContextMenu(menu, module->model->slug);
+#endif
+	}
 };
 
 
@@ -0,0 +1,127 @@
+#pragma once
+#include "plugin.hpp"
+
+using simd::float_4;
+
+
+// Halves the sample rate with a linear-phase half-band FIR. Every other tap
+// of a half-band filter is zero, so the polyphase form below only multiplies
+// the even-phase samples by the TAPS folded coefficient pairs and adds the
+// odd-phase centre tap. The filter is 4 * TAPS - 1 long.
+// T is float, or float_4 for four voices at once.
+template <int TAPS, typename T>
+struct HalfBandDecimator {
+	// Group delay in input samples
+	static const int DELAY = 2 * TAPS - 1;
+
+	float coeffs[TAPS];
+	// Even-phase history, written twice so reads never wrap
+	T evenHistory[4 * TAPS];
+	// Odd-phase history, read TAPS - 1 pairs later for the centre tap
+	T oddHistory[2 * TAPS];
+	int pos = 0;
+
+	HalfBandDecimator() {
+		// Kaiser-windowed sinc, beta = 7 for about 70 dB of stopband rejection
+		const int length = 4 * TAPS - 1;
+		const float beta = 7.f;
+		float sum = 0.f;
+		for (int m = 0; m < TAPS; m++) {
+			// Offset from the centre, always odd
+			int n = 2 * (TAPS - m) - 1;
+			float x = (float) n / (length / 2);
+			float window = besselI0(beta * std::sqrt(1.f - x * x)) / besselI0(beta);
+			coeffs[m] = std::sin(M_PI * n / 2) / (M_PI * n) * window;
+			sum += 2.f * coeffs[m];
+		}
+		// Side taps sum to 1/2 so the DC gain is exactly 1
+		for (int m = 0; m < TAPS; m++)
+			coeffs[m] *= 0.5f / sum;
+		reset();
+	}
+
+	static float besselI0(float x) {
+		float sum = 1.f;
+		float term = 1.f;
+		for (int k = 1; k < 20; k++) {
+			term *= (x / (2 * k)) * (x / (2 * k));
+			sum += term;
+		}
+		return sum;
+	}
+
+	void reset() {
+		for (int i = 0; i < 4 * TAPS; i++)
+			evenHistory[i] = 0.f;
+		for (int i = 0; i < 2 * TAPS; i++)
+			oddHistory[i] = 0.f;
+		pos = 0;
+	}
+
+	/** Takes two consecutive input samples and returns one output sample. */
+	T process(T in0, T in1) {
+		pos = (pos == 0) ? 2 * TAPS - 1 : pos - 1;
+		oddHistory[pos] = in0;
+		evenHistory[pos] = in1;
+		evenHistory[pos + 2 * TAPS] = in1;
+
+		// evenHistory[pos + k] holds the even sample from k pairs ago
+		const T* e = &evenHistory[pos];
+		T out = 0.5f * oddHistory[(pos + TAPS - 1) % (2 * TAPS)];
+		for (int m = 0; m < TAPS; m++)
+			out += coeffs[m] * (e[m] + e[2 * TAPS - 1 - m]);
+		return out;
+	}
+};
+
+
+// Reduces 1x, 2x, 4x or 8x oversampled audio to the engine rate with a cascade
+// of half-band stages. Only the last stage's transition band reaches the audio
+// band, so the earlier, faster stages get away with shorter filters.
+template <typename T>
+struct Decimator {
+	static const int MAX_FACTOR = 8;
+
+	int factor = 1;
+	HalfBandDecimator<6, T> firstStages[2];
+	HalfBandDecimator<12, T> lastStage;
+
+	void setFactor(int newFactor) {
+		if (newFactor == factor)
+			return;
+		factor = newFactor;
+		reset();
+	}
+
+	void reset() {
+		for (int i = 0; i < 2; i++)
+			firstStages[i].reset();
+		lastStage.reset();
+	}
+
+	/** Returns the group delay in output samples, relative to the last input sample. */
+	float getDelay() const {
+		float delay = 0.f;
+		// Each stage delays by its taps at its own input rate
+		for (int rate = factor; rate > 2; rate /= 2)
+			delay += (float) firstStages[0].DELAY / rate;
+		if (factor >= 2)
+			delay += lastStage.DELAY / 2.f;
+		return delay;
+	}
+
+	/** Takes `factor` input samples and returns one output sample. The input
+	 * buffer is used as scratch space. */
+	T process(T* in) {
+		int n = factor;
+		// 8x and 4x run through the short stages until two samples are left
+		for (int stage = 0; n > 2; stage++) {
+			n /= 2;
+			for (int i = 0; i < n; i++)
+				in[i] = firstStages[stage].process(in[2 * i], in[2 * i + 1]);
+		}
+		if (n == 2)
+			return lastStage.process(in[0], in[1]);
+		return in[0];
+	}
+};
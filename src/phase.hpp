@@ -0,0 +1,76 @@
+#pragma once
+#include "plugin.hpp"
+
+using simd::float_4;
+
+
+// 32-bit fixed-point phase shared by every oscillator in the plugin. One cycle
+// spans the full range of the integer, so the phase wraps by overflow for any
+// increment and keeps the same resolution at every frequency. Scalar phases
+// are uint32_t. Four voices or partials are an int32_4, whose additions wrap
+// the same way.
+
+template <typename T>
+struct PhaseInt;
+
+template <>
+struct PhaseInt<float> {
+	typedef uint32_t type;
+};
+
+template <>
+struct PhaseInt<float_4> {
+	typedef simd::int32_4 type;
+};
+
+
+/** Converts cycles to a phase. Only the fractional part matters, so it is
+ * first folded into [-0.5, 0.5), which fits a signed 32-bit integer. */
+inline uint32_t cyclesToPhase(float cycles) {
+	float folded = cycles - std::floor(cycles + 0.5f);
+	return (uint32_t) (int32_t) (folded * 4294967296.f);
+}
+
+inline simd::int32_4 cyclesToPhase(float_4 cycles) {
+	float_4 folded = cycles - simd::floor(cycles + 0.5f);
+	return simd::int32_4(folded * 4294967296.f);
+}
+
+/** Converts a phase to cycles in [0, 1). The top 24 bits fill a float's mantissa. */
+inline float phaseToCycles(uint32_t phase) {
+	return (phase >> 8) * (1.f / 16777216.f);
+}
+
+inline float_4 phaseToCycles(simd::int32_4 phase) {
+	return float_4((phase >> 8) & 0xFFFFFF) * (1.f / 16777216.f);
+}
+
+
+template <typename T>
+struct PhaseAccumulator {
+	typedef typename PhaseInt<T>::type Int;
+
+	Int phase = 0;
+	Int increment = 0;
+
+	void setFrequency(T freq, float sampleTime) {
+		increment = cyclesToPhase(freq * sampleTime);
+	}
+
+	void setIncrement(T cycles) {
+		increment = cyclesToPhase(cycles);
+	}
+
+	void reset(T cycles = 0.f) {
+		phase = cyclesToPhase(cycles);
+	}
+
+	void step() {
+		phase += increment;
+	}
+
+	/** The phase in cycles, in [0, 1) */
+	T get() const {
+		return phaseToCycles(phase);
+	}
+};
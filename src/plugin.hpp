@@ -10,4 +10,12 @@ extern Plugin* pluginInstance;
 // Declare each Model, defined in each module source file
 extern Model* modelSimpleSine;
 extern Model* modelHarm_osc;
-extern Model* modelSub_osc;
\ No newline at end of file
+extern Model* modelSub_osc;
+
+// Implemented by modules that hand work to background threads, so offline
+// tools can run that work inline instead and get the same output every time.
+struct OfflineModule {
+	virtual ~OfflineModule() {}
+	/** Call before dataFromJson(). */
+	virtual void setOffline(bool offline) = 0;
+};
\ No newline at end of file
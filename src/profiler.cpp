@@ -0,0 +1,83 @@
+#include "profiler.hpp"
+
+#ifdef ASTROKKIDD_PROFILE
+
+
+double ProfileStage::meanNs() const {
+	uint64_t n = calls.load(std::memory_order_relaxed);
+	return n > 0 ? (double) totalNs.load(std::memory_order_relaxed) / n : 0.0;
+}
+
+
+double ProfileStage::percentileNs(double fraction) const {
+	uint64_t counts[BUCKETS];
+	uint64_t total = 0;
+	for (int i = 0; i < BUCKETS; i++) {
+		counts[i] = histogram[i].load(std::memory_order_relaxed);
+		total += counts[i];
+	}
+	if (total == 0)
+		return 0.0;
+
+	uint64_t target = std::ceil(fraction * total);
+	uint64_t cumulative = 0;
+	for (int i = 0; i < BUCKETS; i++) {
+		cumulative += counts[i];
+		if (cumulative >= target)
+			return (double) (uint64_t(1) << (i + 1));
+	}
+	return (double) (uint64_t(1) << BUCKETS);
+}
+
+
+void Profiler::reset() {
+	for (ProfileStage& stage : stages)
+		stage.resetRequested.store(true, std::memory_order_relaxed);
+}
+
+
+json_t* Profiler::toJson() const {
+	json_t* stagesJ = json_array();
+	for (const ProfileStage& stage : stages) {
+		json_t* stageJ = json_object();
+		json_object_set_new(stageJ, "name", json_string(stage.name.c_str()));
+		json_object_set_new(stageJ, "calls", json_integer(stage.calls.load(std::memory_order_relaxed)));
+		json_object_set_new(stageJ, "meanNs", json_real(stage.meanNs()));
+		json_object_set_new(stageJ, "p50Ns", json_real(stage.percentileNs(0.5)));
+		json_object_set_new(stageJ, "p99Ns", json_real(stage.percentileNs(0.99)));
+
+		json_t* histogramJ = json_array();
+		for (int i = 0; i < ProfileStage::BUCKETS; i++)
+			json_array_append_new(histogramJ, json_integer(stage.histogram[i].load(std::memory_order_relaxed)));
+		json_object_set_new(stageJ, "histogram", histogramJ);
+
+		json_array_append_new(stagesJ, stageJ);
+	}
+	json_t* rootJ = json_object();
+	json_object_set_new(rootJ, "stages", stagesJ);
+	return rootJ;
+}
+
+
+void Profiler::appendContextMenu(Menu* menu, const std::string& slug) {
+	menu->addChild(createSubmenuItem("Profile", "", [=](Menu* menu) {
+		for (const ProfileStage& stage : stages) {
+			menu->addChild(createMenuLabel(string::f("%s: mean %.0f ns, p50 < %.0f ns, p99 < %.0f ns",
+				stage.name.c_str(), stage.meanNs(), stage.percentileNs(0.5), stage.percentileNs(0.99))));
+		}
+		menu->addChild(new MenuSeparator);
+		menu->addChild(createMenuItem("Reset", "", [=]() {
+			reset();
+		}));
+		menu->addChild(createMenuItem("Save as JSON", "", [=]() {
+			std::string path = asset::user(slug + "-profile.json");
+			json_t* rootJ = toJson();
+			json_dump_file(rootJ, path.c_str(), JSON_INDENT(2));
+			json_decref(rootJ);
+			INFO("Saved profile to %s", path.c_str());
+		}));
+	}));
+}
+
+
+#endif
@@ -0,0 +1,115 @@
+#pragma once
+#include "plugin.hpp"
+
+// Optional per-module DSP profiling, built with `make PROFILE=1`. Without
+// ASTROKKIDD_PROFILE defined, PROFILE_SCOPE expands to nothing and no
+// profiler state exists.
+#ifdef ASTROKKIDD_PROFILE
+
+#include <atomic>
+#include <chrono>
+
+
+// Timing of one stage of a module's process(). Only the engine thread
+// writes, so updates are plain relaxed stores. The UI thread reads with
+// relaxed loads and never blocks the engine.
+struct ProfileStage {
+	// Bucket i counts calls taking [2^i, 2^(i + 1)) ns
+	static const int BUCKETS = 20;
+	// Counts are halved every this many calls, so the histogram follows the
+	// patch as it changes instead of averaging over the whole session
+	static const uint64_t DECAY_CALLS = 1 << 16;
+
+	std::string name;
+	std::atomic<uint64_t> calls{0};
+	std::atomic<uint64_t> totalNs{0};
+	std::atomic<uint32_t> histogram[BUCKETS];
+	// Set by the UI thread, acted on by the engine thread
+	std::atomic<bool> resetRequested{false};
+	uint64_t callsSinceDecay = 0;
+
+	ProfileStage() {
+		for (int i = 0; i < BUCKETS; i++)
+			histogram[i].store(0, std::memory_order_relaxed);
+	}
+
+	void record(uint64_t ns) {
+		if (resetRequested.load(std::memory_order_relaxed)) {
+			clear();
+			resetRequested.store(false, std::memory_order_relaxed);
+		}
+
+		calls.store(calls.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		totalNs.store(totalNs.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+		int bucket = 0;
+		while (bucket < BUCKETS - 1 && (ns >> (bucket + 1)) > 0)
+			bucket++;
+		histogram[bucket].store(histogram[bucket].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+		if (++callsSinceDecay >= DECAY_CALLS) {
+			callsSinceDecay = 0;
+			decay();
+		}
+	}
+
+	void clear() {
+		calls.store(0, std::memory_order_relaxed);
+		totalNs.store(0, std::memory_order_relaxed);
+		for (int i = 0; i < BUCKETS; i++)
+			histogram[i].store(0, std::memory_order_relaxed);
+		callsSinceDecay = 0;
+	}
+
+	void decay() {
+		calls.store(calls.load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+		totalNs.store(totalNs.load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+		for (int i = 0; i < BUCKETS; i++)
+			histogram[i].store(histogram[i].load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+	}
+
+	double meanNs() const;
+	/** Upper bound in ns of the bucket holding the given fraction of calls. */
+	double percentileNs(double fraction) const;
+};
+
+
+struct Profiler {
+	std::vector<ProfileStage> stages;
+
+	Profiler(const std::vector<std::string>& names) : stages(names.size()) {
+		for (size_t i = 0; i < names.size(); i++)
+			stages[i].name = names[i];
+	}
+
+	/** Asks the engine thread to clear the counters at its next record. */
+	void reset();
+	json_t* toJson() const;
+	/** Adds a Profile submenu showing each stage, with reset and save items. */
+	void appendContextMenu(Menu* menu, const std::string& slug);
+};
+
+
+// Times its enclosing scope into a ProfileStage
+struct ScopedTimer {
+	typedef std::chrono::steady_clock Clock;
+
+	ProfileStage& stage;
+	Clock::time_point start;
+
+	ScopedTimer(ProfileStage& stage) : stage(stage), start(Clock::now()) {}
+
+	~ScopedTimer() {
+		stage.record(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+	}
+};
+
+#define PROFILE_CONCAT2(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+// Times the rest of the enclosing scope into the module's `profiler` stage
+#define PROFILE_SCOPE(stage) ScopedTimer PROFILE_CONCAT(profileTimer, __LINE__)(profiler.stages[stage])
+
+#else
+
+#define PROFILE_SCOPE(stage)
+
+#endif
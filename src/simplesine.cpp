@@ -1,4 +1,9 @@
 #include "plugin.hpp"
+#include "fastmath.hpp"
+#include "phase.hpp"
+#include "profiler.hpp"
+
+using simd::float_4;
 
 
 struct SimpleSine : Module {
@@ -18,10 +23,25 @@ struct SimpleSine : Module {
 		BLINK_LIGHT,
 		LIGHTS_LEN
 	};
+	enum ProfileId {
+		PITCH_PROFILE,
+		OSCILLATOR_PROFILE,
+		PROFILES_LEN
+	};
 
-	float phase = 0.f;
+	PhaseAccumulator<float_4> phase[4];
 	float blinkPhase = 0.f;
 
+	// Rebuilt by onSampleRateChange(). The phase increment of a voice is
+	// freqScale * 2^pitch.
+	float sampleTime = 1.f / 44100.f;
+	float freqScale = dsp::FREQ_C4 / 44100.f;
+
+#ifdef ASTROKKIDD_PROFILE
+	// Indexed by ProfileId
+	Profiler profiler{{"Pitch", "Oscillator"}};
+#endif
+
 	SimpleSine() {
 		config(PARAMS_LEN, INPUTS_LEN, OUTPUTS_LEN, LIGHTS_LEN);
 		configParam(PITCH_PARAM, -5.f, 5.f, 0.f, "Pitch (1V/Oct)", " Hz", 2, dsp::FREQ_C4);
@@ -29,20 +49,36 @@ struct SimpleSine : Module {
 		configOutput(SINE_OUTPUT, "Sine");
 	}
 
-	void process(const ProcessArgs& args) override {
-
-		float pitch = params[PITCH_PARAM].getValue();
-		pitch += inputs[PITCH_INPUT].getVoltage();
-
-		float freq = dsp::FREQ_C4 * std::pow(2.f, pitch);
-
-		phase += freq * args.sampleTime;
-		if (phase >= 1.f) { phase -= 1.f; }
-
-		float sine = std::sin(2.f * M_PI * phase);
-		outputs[SINE_OUTPUT].setVoltage(5.f * sine);
+	void onSampleRateChange(const SampleRateChangeEvent& e) override {
+		sampleTime = e.sampleTime;
+		freqScale = dsp::FREQ_C4 * e.sampleTime;
+	}
 
-		blinkPhase += args.sampleTime;
+	void process(const ProcessArgs& args) override {
+		// One voice per PITCH_INPUT channel, processed four at a time
+		int channels = std::max(1, inputs[PITCH_INPUT].getChannels());
+
+		float pitchParam = params[PITCH_PARAM].getValue();
+
+		for (int c = 0; c < channels; c += 4) {
+			float_4 increment;
+			{
+				PROFILE_SCOPE(PITCH_PROFILE);
+				float_4 pitch = pitchParam + inputs[PITCH_INPUT].getPolyVoltageSimd<float_4>(c);
+				increment = freqScale * fastmath::exp2(pitch);
+			}
+
+			PROFILE_SCOPE(OSCILLATOR_PROFILE);
+			PhaseAccumulator<float_4>& p = phase[c / 4];
+			p.setIncrement(increment);
+			p.step();
+
+			float_4 sine = fastmath::sin2pi(p.get());
+			outputs[SINE_OUTPUT].setVoltageSimd(5.f * sine, c);
+		}
+		outputs[SINE_OUTPUT].setChannels(channels);
+
+		blinkPhase += sampleTime;
 		if (blinkPhase >= 1.f) { blinkPhase -= 1.f; }
 		lights[BLINK_LIGHT].setBrightness(blinkPhase < 0.5f ? 1.f : 0.f);
 
@@ -68,6 +104,15 @@ struct SimpleSineWidget : ModuleWidget {
 
 		addChild(createLightCentered<MediumLight<RedLight>>(mm2px(Vec(15.24, 40.593)), module, SimpleSine::BLINK_LIGHT));
 	}
+
+#ifdef ASTROKKIDD_PROFILE
+	void appendContextMenu(Menu* menu) override {
+		SimpleSine* module = getModule<SimpleSine>();
+
+		menu->addChild(new MenuSeparator);
+		module->profiler.appendContextMenu(menu, module->model->slug);
+	}
+#endif
 };
 
 
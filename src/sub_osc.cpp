@@ -1,132 +1,18 @@
 #include "plugin.hpp"
-#include <cmath>
+#include "dspcore.hpp"
+#include "oversampling.hpp"
+#include "profiler.hpp"
 
-// Simple oscillator class
-struct BasicOscillator {
-    float phase = 0.f;
-    float freq = 0.f;
-    float pw = 0.5f;
-    
-    void updatePhase(float deltaTime) {
-        phase += freq * deltaTime;
-        if (phase >= 1.f)
-            phase -= 1.f;
-    }
-    
-    float sine() {
-        return std::sin(2.f * M_PI * phase);
-    }
-    
-    float triangle() {
-        float t = phase;
-        if (t < 0.5f)
-            return 4.f * t - 1.f;
-        else
-            return 3.f - 4.f * t;
-    }
-    
-    float saw() {
-        return 2.f * phase - 1.f;
-    }
-    
-    float square() {
-        return (phase < pw) ? 1.f : -1.f;
-    }
-};
 
-// Simple ADSR envelope
-struct ADSREnvelope {
-    enum Stage {
-        IDLE,
-        ATTACK,
-        DECAY,
-        SUSTAIN,
-        RELEASE
-    };
-    
-    Stage stage = IDLE;
-    float output = 0.f;
-    float attackTime = 0.1f;
-    float decayTime = 0.3f;
-    float sustainLevel = 0.5f;
-    float releaseTime = 1.0f;
-    float stageProgress = 0.f;
-    bool gateWasHigh = false;
-    
-    void process(float deltaTime, bool gate) {
-        // State transitions
-        if (gate && !gateWasHigh) {
-            // Gate rising edge
-            stage = ATTACK;
-            stageProgress = 0.f;
-        }
-        else if (!gate && gateWasHigh) {
-            // Gate falling edge
-            if (stage != IDLE) {
-                stage = RELEASE;
-                stageProgress = 0.f;
-            }
-        }
-        
-        gateWasHigh = gate;
-        
-        // State processing
-        switch (stage) {
-            case IDLE:
-                output = 0.f;
-                break;
-                
-            case ATTACK:
-                stageProgress += deltaTime;
-                output = stageProgress / attackTime;
-                if (output >= 1.f) {
-                    output = 1.f;
-                    stage = DECAY;
-                    stageProgress = 0.f;
-                }
-                break;
-                
-            case DECAY:
-                stageProgress += deltaTime;
-                output = 1.f - (1.f - sustainLevel) * (stageProgress / decayTime);
-                if (stageProgress >= decayTime) {
-                    output = sustainLevel;
-                    stage = SUSTAIN;
-                }
-                break;
-                
-            case SUSTAIN:
-                output = sustainLevel;
-                break;
-                
-            case RELEASE:
-                stageProgress += deltaTime;
-                output = sustainLevel * (1.f - stageProgress / releaseTime);
-                if (stageProgress >= releaseTime) {
-                    output = 0.f;
-                    stage = IDLE;
-                }
-                break;
-        }
-    }
-};
+// One oscillator's work for one engine sample, run over `steps` oversampled
+// steps. It advances the phase, adds each patched waveform scaled by its level
+// to waves[wave][step], and adds the mixed ones to mix[step]. Unison copies of
+// an oscillator accumulate into the same buffers. See getOscKernel().
+typedef void (*OscKernel)(BasicOscillator<float_4>& osc, float deltaTime, int steps, const float* levels, float_4 (*waves)[Decimator<float_4>::MAX_FACTOR], float_4* mix);
+
+// Returns the kernel for a quality and bit sets of patched and mixed waveforms
+static OscKernel getOscKernel(int quality, int output, int mixed);
 
-// One-pole low-pass filter
-struct OnePoleFilter {
-    float output = 0.f;
-    float cutoff = 1000.f;
-    float sampleRate = 44100.f;
-    
-    void process(float input) {
-        // Convert cutoff frequency to coefficient
-        float rc = 1.f / (2.f * M_PI * cutoff);
-        float dt = 1.f / sampleRate;
-        float alpha = dt / (rc + dt);
-        
-        // Apply filter
-        output = output + alpha * (input - output);
-    }
-};
 
 struct Sub_osc : Module {
     enum ParamId {
@@ -158,6 +44,11 @@ struct Sub_osc : Module {
         ENV_RELEASE_PARAM,
         LFO1_FREQ_PARAM,
         LFO2_LEVEL_PARAM,
+        FILTER_RES_PARAM,
+        FILTER_MODE_PARAM,
+        FILTER_SLOPE_PARAM,
+        UNISON_DETUNE_PARAM,
+        UNISON_SPREAD_PARAM,
         PARAMS_LEN
     };
     enum InputId {
@@ -184,24 +75,142 @@ struct Sub_osc : Module {
         ENV_OUT_OUTPUT,
         LFO1_OUT_OUTPUT,
         AMP_OUT_OUTPUT,
+        AMP_OUT_RIGHT_OUTPUT,
         OUTPUTS_LEN
     };
     enum LightId {
         LIGHTS_LEN
     };
+    enum Wave {
+        TRI_WAVE,
+        SAW_WAVE,
+        SQR_WAVE,
+        WAVES_LEN
+    };
+    enum Quality {
+        NAIVE_QUALITY,
+        POLYBLEP_QUALITY,
+        MINBLEP_QUALITY,
+        QUALITIES_LEN
+    };
+    enum ProfileId {
+        CONTROLS_PROFILE,
+        ENVELOPE_PROFILE,
+        OSCILLATORS_PROFILE,
+        FILTER_PROFILE,
+        OUTPUT_PROFILE,
+        PROFILES_LEN
+    };
+    
+    // Anti-aliasing used for the audio oscillators, chosen in the context menu
+    int quality = POLYBLEP_QUALITY;
+    // The oscillators and filter run at this multiple of the engine rate.
+    // oversample is chosen in the context menu, and processControls() adopts
+    // it as oversampleFactor, so the factor never changes during a process()
+    // call.
+    int oversample = 1;
+    int oversampleFactor = 1;
+    // Engine and oversampled sample times. Only change in onSampleRateChange()
+    // and when a new factor is adopted.
+    float sampleTime = 1.f / 44100.f;
+    float subTime = 1.f / 44100.f;
 
-    // Oscillators
-    BasicOscillator osc1;
-    BasicOscillator osc2;
-    BasicOscillator osc3;
-    BasicOscillator lfo1;
-    BasicOscillator lfo2;
+    // Unison stacks detuned copies of every oscillator on each voice, spread
+    // evenly over the detune range and the stereo field. Polyphonic, copy u
+    // of a group is osc[i][g][u], one more kernel call across the group's
+    // four channels. A single voice packs its copies into the lanes instead,
+    // copy u in lane u % 4 of osc[i][0][u / 4], so a stack of eight is two
+    // kernel calls.
+    static const int MAX_UNISON = 8;
+    static const int MAX_UNISON_PACKS = MAX_UNISON / 4;
+    // Chosen in the context menu. The audio thread adopts it in
+    // processControls().
+    int unison = 1;
+    int unisonVoices = 1;
+    bool unisonPacked = false;
+    
+    // Oscillators, indexed by oscillator, by group of four polyphony channels
+    // and by unison copy
+    BasicOscillator<float_4> osc[3][4][MAX_UNISON];
+    
+    // LFOs are shared by all voices
+    BasicOscillator<float> lfo1;
+    BasicOscillator<float> lfo2;
+    
+    // Envelopes
+    ADSREnvelope env[4];
+    
+    // Filters. The right ones only run while the unison copies are panned
+    // apart.
+    SVFilter<float_4> filter[4];
+    SVFilter<float_4> filterRight[4];
+    
+    // Bring oversampled waveforms and the filtered mix back to the engine rate,
+    // indexed by group of four polyphony channels
+    Decimator<float_4> waveDecimator[3][WAVES_LEN][4];
+    Decimator<float_4> ampDecimator[4];
+    Decimator<float_4> ampDecimatorRight[4];
+    
+    // Params and slow CVs are read every controlPeriod samples by
+    // processControls(). controlDivision is chosen in the context menu, and
+    // processControls() adopts it as controlPeriod, so the ramps it starts
+    // always last as long as the period they were computed for.
+    int controlDivision = 16;
+    int controlPeriod = 16;
+    dsp::ClockDivider controlDivider;
+    bool controlsInitialized = false;
     
-    // Envelope
-    ADSREnvelope env;
+    float oscRatio[3] = {1.f, 1.f, 1.f};
+    float oscWidth[3] = {};
+    float oscPwmAmount[3] = {};
+    // Level of each waveform, indexed by oscillator and then by Wave
+    float oscLevel[3][WAVES_LEN] = {};
+    // Pitch ratio of each oscillator's unison copies
+    float unisonRatio[3][MAX_UNISON] = {};
+    // Waveform levels scaled down for the number of copies
+    float unisonLevel[3][WAVES_LEN] = {};
+    // Gain of each copy in the left and right mixes
+    float unisonLeft[MAX_UNISON] = {};
+    float unisonRight[MAX_UNISON] = {};
+    // The same for the packed layout. Lanes past the last copy have no gain.
+    float_4 packedRatio[3][MAX_UNISON_PACKS];
+    float_4 packedGain[MAX_UNISON_PACKS];
+    float_4 packedLeft[MAX_UNISON_PACKS];
+    float_4 packedRight[MAX_UNISON_PACKS];
+    float lfo1Level = 0.f;
+    float lfo2Level = 0.f;
     
-    // Filter
-    OnePoleFilter filter;
+    // Values ramped linearly between control updates to avoid zipper noise.
+    // The filter ramps its own coefficients.
+    float vcaGain = 0.f;
+    float vcaGainStep = 0.f;
+    
+    // The work the current patch needs, refreshed by updateActiveSet(). A
+    // waveform is computed only if its output is patched or it is audible at
+    // AMP_OUT.
+    bool waveActive[3][WAVES_LEN] = {};
+    bool waveOutput[3][WAVES_LEN] = {};
+    bool waveMixed[3][WAVES_LEN] = {};
+    // Specialized for each oscillator's active set and the quality
+    OscKernel oscKernel[3] = {};
+    bool anyWaveOutput = false;
+    bool ampActive = false;
+    bool rightActive = false;
+    // The right output has its own mix, filter and decimator
+    bool stereo = false;
+    bool envOutput = false;
+    bool lfo1Output = false;
+    bool lfo2Output = false;
+    
+    // Groups whose voices have all released sleep until the next gate, and
+    // count the samples they have not yet caught their phases up on
+    bool groupIdle[4] = {};
+    int idleSamples[4] = {};
+    
+#ifdef ASTROKKIDD_PROFILE
+    // Indexed by ProfileId
+    Profiler profiler{{"Controls", "Envelope", "Oscillators", "Filter", "Output"}};
+#endif
     
     Sub_osc() {
         config(PARAMS_LEN, INPUTS_LEN, OUTPUTS_LEN, LIGHTS_LEN);
@@ -233,6 +242,11 @@ struct Sub_osc : Module {
         configParam(ENV_RELEASE_PARAM, 0.001f, 10.f, 1.f, "Release Time", " s", 0.f, 1.f);
         configParam(LFO1_FREQ_PARAM, 0.01f, 10.f, 0.5f, "LFO 1 Frequency", " Hz", 0.f, 1.f);
         configParam(LFO2_LEVEL_PARAM, 0.f, 1.f, 0.5f, "LFO 2 Level", "%", 0.f, 100.f);
+        configParam(FILTER_RES_PARAM, 0.f, 1.f, 0.f, "Filter Resonance", "%", 0.f, 100.f);
+        configSwitch(FILTER_MODE_PARAM, 0.f, 2.f, 0.f, "Filter Mode", {"Lowpass", "Bandpass", "Highpass"});
+        configSwitch(FILTER_SLOPE_PARAM, 0.f, 1.f, 0.f, "Filter Slope", {"12 dB/oct", "24 dB/oct"});
+        configParam(UNISON_DETUNE_PARAM, 0.f, 100.f, 20.f, "Unison Detune", " cents");
+        configParam(UNISON_SPREAD_PARAM, 0.f, 1.f, 0.5f, "Unison Stereo Spread", "%", 0.f, 100.f);
         
         configInput(VOCT_INPUT, "V/Oct");
         configInput(AMP_CV_INPUT, "AMP CV");
@@ -255,122 +269,537 @@ struct Sub_osc : Module {
         configOutput(ENV_OUT_OUTPUT, "Envelope");
         configOutput(LFO1_OUT_OUTPUT, "LFO 1");
         configOutput(AMP_OUT_OUTPUT, "Output");
+        configOutput(AMP_OUT_RIGHT_OUTPUT, "Output Right");
+        
+        controlDivider.setDivision(controlPeriod);
     }
 
-    void process(const ProcessArgs& args) override {
-        float deltaTime = args.sampleTime;
-        filter.sampleRate = args.sampleRate;
-        
-        // Process LFOs
-        lfo1.freq = params[LFO1_FREQ_PARAM].getValue();
-        lfo2.freq = params[LFO2_FREQ_PARAM].getValue();
+    json_t* dataToJson() override {
+        json_t* rootJ = json_object();
+        json_object_set_new(rootJ, "quality", json_integer(quality));
+        json_object_set_new(rootJ, "controlDivision", json_integer(controlDivision));
+        json_object_set_new(rootJ, "oversample", json_integer(oversample));
+        json_object_set_new(rootJ, "unison", json_integer(unison));
+        return rootJ;
+    }
+    
+    void dataFromJson(json_t* rootJ) override {
+        json_t* qualityJ = json_object_get(rootJ, "quality");
+        if (qualityJ)
+            quality = clamp((int) json_integer_value(qualityJ), 0, QUALITIES_LEN - 1);
         
-        lfo1.updatePhase(deltaTime);
-        lfo2.updatePhase(deltaTime);
+        json_t* controlDivisionJ = json_object_get(rootJ, "controlDivision");
+        if (controlDivisionJ)
+            setControlDivision(json_integer_value(controlDivisionJ));
         
-        float lfo1Out = lfo1.triangle() * params[LFO1_LEVEL_PARAM].getValue();
-        float lfo2Out = lfo2.triangle() * params[LFO2_LEVEL_PARAM].getValue();
+        json_t* oversampleJ = json_object_get(rootJ, "oversample");
+        if (oversampleJ)
+            setOversample(json_integer_value(oversampleJ));
         
-        // Set LFO outputs
-        outputs[LFO1_OUT_OUTPUT].setVoltage(5.f * lfo1Out);
-        outputs[LFO2_OUT_OUTPUT].setVoltage(5.f * lfo2Out);
+        json_t* unisonJ = json_object_get(rootJ, "unison");
+        if (unisonJ)
+            unison = clamp((int) json_integer_value(unisonJ), 1, MAX_UNISON);
+    }
+    
+    void setControlDivision(int division) {
+        controlDivision = clamp(division, 1, 64);
+    }
+    
+    void setOversample(int factor) {
+        // Only powers of two up to the decimator's limit
+        int f = 1;
+        while (f < factor && f < Decimator<float_4>::MAX_FACTOR)
+            f *= 2;
+        oversample = f;
+    }
+    
+    // Starts copies from `first` on at scattered phases, so a stack does not
+    // open with every copy in phase
+    void scatterUnison(int first) {
+        for (int u = first; u < unisonVoices; u++) {
+            float start = u * 0.618034f;
+            start -= std::floor(start);
+            for (int i = 0; i < 3; i++) {
+                if (unisonPacked) {
+                    BasicOscillator<float_4>& o = osc[i][0][u / 4];
+                    o.accumulator.phase[u % 4] = cyclesToPhase(start);
+                    o.phase[u % 4] = start;
+                    continue;
+                }
+                for (int g = 0; g < 4; g++) {
+                    osc[i][g][u].accumulator.reset(start);
+                    osc[i][g][u].phase = start;
+                }
+            }
+        }
+    }
+    
+    void setUnisonVoices(int voices) {
+        int first = unisonVoices;
+        unisonVoices = voices;
+        scatterUnison(first);
+    }
+    
+    // Switching layouts keeps copy 0 and restarts the others
+    void setUnisonPacked(bool packed) {
+        unisonPacked = packed;
+        scatterUnison(1);
+    }
+    
+    void onSampleRateChange(const SampleRateChangeEvent& e) override {
+        sampleTime = e.sampleTime;
+        subTime = sampleTime / oversampleFactor;
+    }
+    
+    // Works out which waveforms and outputs the patch needs. Only port
+    // connections and level params feed into this, so it runs with the other
+    // control-rate work.
+    void updateActiveSet() {
+        rightActive = outputs[AMP_OUT_RIGHT_OUTPUT].isConnected();
+        ampActive = outputs[AMP_OUT_OUTPUT].isConnected() || rightActive;
+        envOutput = outputs[ENV_OUT_OUTPUT].isConnected();
+        lfo1Output = outputs[LFO1_OUT_OUTPUT].isConnected();
+        lfo2Output = outputs[LFO2_OUT_OUTPUT].isConnected();
         
-        // Process envelope
-        bool gate = inputs[ENV_GATE_INPUT].getVoltage() >= 1.f;
+        anyWaveOutput = false;
+        for (int i = 0; i < 3; i++) {
+            int output = 0;
+            int mixed = 0;
+            for (int w = 0; w < WAVES_LEN; w++) {
+                waveOutput[i][w] = outputs[OSC1_TRI_OUTPUT + 3 * w + i].isConnected();
+                waveMixed[i][w] = ampActive && oscLevel[i][w] != 0.f;
+                waveActive[i][w] = waveOutput[i][w] || waveMixed[i][w];
+                anyWaveOutput |= waveOutput[i][w];
+                output |= waveOutput[i][w] << w;
+                mixed |= waveMixed[i][w] << w;
+            }
+            oscKernel[i] = getOscKernel(quality, output, mixed);
+        }
+    }
+    
+    // Reads params and slow CVs. Runs once every controlPeriod samples.
+    void processControls(const ProcessArgs& args, int channels) {
+        // Read once, as the menu may write it at any time. The divider has
+        // just fired, so the new period starts here.
+        int requestedDivision = controlDivision;
+        if (requestedDivision != controlPeriod) {
+            controlPeriod = requestedDivision;
+            controlDivider.setDivision(controlPeriod);
+            controlDivider.reset();
+        }
         
-        env.attackTime = params[ENV_ATTACK_PARAM].getValue();
-        env.decayTime = params[ENV_DECAY_PARAM].getValue();
-        env.sustainLevel = params[ENV_SUSTAIN_PARAM].getValue();
-        env.releaseTime = params[ENV_RELEASE_PARAM].getValue();
+        int requestedOversample = oversample;
+        if (requestedOversample != oversampleFactor) {
+            oversampleFactor = requestedOversample;
+            subTime = sampleTime / oversampleFactor;
+        }
         
-        env.process(deltaTime, gate);
-        outputs[ENV_OUT_OUTPUT].setVoltage(10.f * env.output);
+        lfo1.freq = params[LFO1_FREQ_PARAM].getValue();
+        lfo2.freq = params[LFO2_FREQ_PARAM].getValue();
+        lfo1Level = params[LFO1_LEVEL_PARAM].getValue();
+        lfo2Level = params[LFO2_LEVEL_PARAM].getValue();
         
-        // Process V/Oct input
-        float pitch = 0.f;
-        if (inputs[VOCT_INPUT].isConnected()) {
-            pitch = inputs[VOCT_INPUT].getVoltage();
+        float attackTime = params[ENV_ATTACK_PARAM].getValue();
+        float decayTime = params[ENV_DECAY_PARAM].getValue();
+        float sustainLevel = params[ENV_SUSTAIN_PARAM].getValue();
+        float releaseTime = params[ENV_RELEASE_PARAM].getValue();
+        for (int g = 0; g < 4; g++) {
+            env[g].setParams(attackTime, decayTime, sustainLevel, releaseTime, sampleTime);
         }
         
-        // Set oscillator parameters
-        osc1.freq = dsp::FREQ_C4 * std::pow(2.f, pitch + params[OSC1_FREQ_PARAM].getValue());
-        osc2.freq = dsp::FREQ_C4 * std::pow(2.f, pitch + params[OSC2_FREQ_PARAM].getValue());
-        osc3.freq = dsp::FREQ_C4 * std::pow(2.f, pitch + params[OSC3_FREQ_PARAM].getValue());
+        // Oscillator params are laid out OSC1, OSC2, OSC3 for each control
+        for (int i = 0; i < 3; i++) {
+            oscRatio[i] = fastmath::exp2(params[OSC1_FREQ_PARAM + i].getValue());
+            oscWidth[i] = params[OSC1_WIDTH_PARAM + i].getValue();
+            oscPwmAmount[i] = params[OSC1_PWM_PARAM + i].getValue();
+            oscLevel[i][TRI_WAVE] = params[OSC1_TRI_LEVEL_PARAM + i].getValue();
+            oscLevel[i][SAW_WAVE] = params[OSC1_SAW_LEVEL_PARAM + i].getValue();
+            oscLevel[i][SQR_WAVE] = params[OSC1_SQR_LEVEL_PARAM + i].getValue();
+        }
         
-        // Process PWM
-        float osc1PwmAmount = params[OSC1_PWM_PARAM].getValue();
-        float osc2PwmAmount = params[OSC2_PWM_PARAM].getValue();
-        float osc3PwmAmount = params[OSC3_PWM_PARAM].getValue();
+        updateActiveSet();
         
-        float osc1PwmCV = inputs[OSC1_PWM_CV_INPUT].getVoltage() / 10.f;
-        float osc2PwmCV = inputs[OSC2_PWM_CV_INPUT].getVoltage() / 10.f;
-        float osc3PwmCV = inputs[OSC3_PWM_CV_INPUT].getVoltage() / 10.f;
+        // Unison copies, from the lowest to the highest detune and from left
+        // to right. Their summed power stays that of one copy.
+        if (unison != unisonVoices)
+            setUnisonVoices(unison);
+        float detune = params[UNISON_DETUNE_PARAM].getValue() * (1.f / 1200.f);
+        float spread = params[UNISON_SPREAD_PARAM].getValue();
+        float unisonGain = 1.f / std::sqrt((float) unisonVoices);
+        for (int u = 0; u < unisonVoices; u++) {
+            float position = (unisonVoices > 1) ? 2.f * u / (unisonVoices - 1) - 1.f : 0.f;
+            float ratio = std::exp2(detune * position);
+            for (int i = 0; i < 3; i++)
+                unisonRatio[i][u] = oscRatio[i] * ratio;
+            // Equal-power pan, unity gain in the center
+            float angle = (1.f + spread * position) * (float) (M_PI / 4);
+            unisonLeft[u] = (float) M_SQRT2 * std::cos(angle);
+            unisonRight[u] = (float) M_SQRT2 * std::sin(angle);
+        }
+        for (int i = 0; i < 3; i++) {
+            for (int w = 0; w < WAVES_LEN; w++)
+                unisonLevel[i][w] = oscLevel[i][w] * unisonGain;
+        }
+        for (int u = 0; u < MAX_UNISON; u++) {
+            bool live = u < unisonVoices;
+            for (int i = 0; i < 3; i++)
+                packedRatio[i][u / 4][u % 4] = live ? unisonRatio[i][u] : 1.f;
+            packedGain[u / 4][u % 4] = live ? 1.f : 0.f;
+            packedLeft[u / 4][u % 4] = live ? unisonLeft[u] : 0.f;
+            packedRight[u / 4][u % 4] = live ? unisonRight[u] : 0.f;
+        }
         
-        osc1.pw = clamp(params[OSC1_WIDTH_PARAM].getValue() + osc1PwmAmount * osc1PwmCV * 0.5f, 0.01f, 0.99f);
-        osc2.pw = clamp(params[OSC2_WIDTH_PARAM].getValue() + osc2PwmAmount * osc2PwmCV * 0.5f, 0.01f, 0.99f);
-        osc3.pw = clamp(params[OSC3_WIDTH_PARAM].getValue() + osc3PwmAmount * osc3PwmCV * 0.5f, 0.01f, 0.99f);
+        // The right channel takes over the left one's state when it splits
+        // off, so it starts from the same point
+        bool wasStereo = stereo;
+        stereo = rightActive && unisonVoices > 1 && spread > 0.f;
+        if (stereo && !wasStereo) {
+            for (int g = 0; g < 4; g++) {
+                filterRight[g] = filter[g];
+                ampDecimatorRight[g] = ampDecimator[g];
+            }
+        }
         
-        // Update oscillator phases
-        osc1.updatePhase(deltaTime);
-        osc2.updatePhase(deltaTime);
-        osc3.updatePhase(deltaTime);
+        // Exponential cutoff control with CV - cap at 20kHz
+        float cutoffBase = params[FILTER_CUTOFF_PARAM].getValue();
+        float resonance = params[FILTER_RES_PARAM].getValue();
+        int filterMode = (int) params[FILTER_MODE_PARAM].getValue();
+        bool fourPole = params[FILTER_SLOPE_PARAM].getValue() > 0.f;
+        for (int c = 0; c < channels; c += 4) {
+            int g = c / 4;
+            float_4 cutoffCV = inputs[FILTER_CUT_CV_INPUT].getPolyVoltageSimd<float_4>(c) * 0.1f; // Normalize to 0-1 range
+            float_4 cutoff = simd::clamp(cutoffBase * fastmath::exp2(cutoffCV * 10.f), 20.f, 20000.f);
+            filter[g].mode = filterMode;
+            filter[g].fourPole = fourPole;
+            filter[g].setParams(cutoff, resonance, subTime, controlPeriod * oversampleFactor);
+            if (stereo) {
+                filterRight[g].mode = filterMode;
+                filterRight[g].fourPole = fourPole;
+                filterRight[g].setParams(cutoff, resonance, subTime, controlPeriod * oversampleFactor);
+            }
+        }
         
-        // Get oscillator outputs
-        float osc1Tri = osc1.triangle() * params[OSC1_TRI_LEVEL_PARAM].getValue();
-        float osc2Tri = osc2.triangle() * params[OSC2_TRI_LEVEL_PARAM].getValue();
-        float osc3Tri = osc3.triangle() * params[OSC3_TRI_LEVEL_PARAM].getValue();
+        float gain = params[AMP_LEVEL_PARAM].getValue();
+        if (!controlsInitialized)
+            vcaGain = gain;
+        vcaGainStep = (gain - vcaGain) / controlPeriod;
         
-        float osc1Saw = osc1.saw() * params[OSC1_SAW_LEVEL_PARAM].getValue();
-        float osc2Saw = osc2.saw() * params[OSC2_SAW_LEVEL_PARAM].getValue();
-        float osc3Saw = osc3.saw() * params[OSC3_SAW_LEVEL_PARAM].getValue();
+        controlsInitialized = true;
+    }
+    
+    void process(const ProcessArgs& args) override {
+        float deltaTime = sampleTime;
         
-        float osc1Sqr = osc1.square() * params[OSC1_SQR_LEVEL_PARAM].getValue();
-        float osc2Sqr = osc2.square() * params[OSC2_SQR_LEVEL_PARAM].getValue();
-        float osc3Sqr = osc3.square() * params[OSC3_SQR_LEVEL_PARAM].getValue();
+        // Voice count follows the widest of the V/Oct and gate inputs
+        int channels = std::max(1, std::max(inputs[VOCT_INPUT].getChannels(), inputs[ENV_GATE_INPUT].getChannels()));
         
-        // Set individual oscillator outputs
-        outputs[OSC1_TRI_OUTPUT].setVoltage(5.f * osc1Tri);
-        outputs[OSC2_TRI_OUTPUT].setVoltage(5.f * osc2Tri);
-        outputs[OSC3_TRI_OUTPUT].setVoltage(5.f * osc3Tri);
+        if (controlDivider.process() || !controlsInitialized) {
+            PROFILE_SCOPE(CONTROLS_PROFILE);
+            processControls(args, channels);
+        }
+        int factor = oversampleFactor;
         
-        outputs[OSC1_SAW_OUTPUT].setVoltage(5.f * osc1Saw);
-        outputs[OSC2_SAW_OUTPUT].setVoltage(5.f * osc2Saw);
-        outputs[OSC3_SAW_OUTPUT].setVoltage(5.f * osc3Saw);
+        // Process LFOs
+        lfo1.updatePhase(deltaTime);
+        lfo2.updatePhase(deltaTime);
         
-        outputs[OSC1_SQR_OUTPUT].setVoltage(5.f * osc1Sqr);
-        outputs[OSC2_SQR_OUTPUT].setVoltage(5.f * osc2Sqr);
-        outputs[OSC3_SQR_OUTPUT].setVoltage(5.f * osc3Sqr);
+        float lfo1Out = lfo1Output ? lfo1.triangle() * lfo1Level : 0.f;
+        float lfo2Out = lfo2Output ? lfo2.triangle() * lfo2Level : 0.f;
         
-        // Mix all oscillator outputs
-        float mixedOutput = (osc1Tri + osc1Saw + osc1Sqr + 
-                            osc2Tri + osc2Saw + osc2Sqr + 
-                            osc3Tri + osc3Saw + osc3Sqr) / 9.f; // Normalize the mix
+        // Set LFO outputs
+        if (lfo1Output)
+            outputs[LFO1_OUT_OUTPUT].setVoltage(5.f * lfo1Out);
+        if (lfo2Output)
+            outputs[LFO2_OUT_OUTPUT].setVoltage(5.f * lfo2Out);
         
-        // Process filter
-        float cutoffBase = params[FILTER_CUTOFF_PARAM].getValue();
-        float cutoffCV = inputs[FILTER_CUT_CV_INPUT].getVoltage() / 10.f; // Normalize to 0-1 range
+        vcaGain += vcaGainStep;
+        bool gateConnected = inputs[ENV_GATE_INPUT].isConnected();
         
-        // Exponential cutoff control with CV - cap at 20kHz
-        filter.cutoff = clamp(cutoffBase * pow(2.f, cutoffCV * 10.f), 20.f, 20000.f);
-        filter.process(mixedOutput);
+        bool packed = channels == 1 && unisonVoices > 1;
+        if (packed != unisonPacked)
+            setUnisonPacked(packed);
+        int oscCopies = packed ? (unisonVoices + 3) / 4 : unisonVoices;
         
-        // Process VCA
-        float vcaGain = params[AMP_LEVEL_PARAM].getValue();
-        float vcaCV = inputs[AMP_CV_INPUT].getVoltage() / 10.f; // Normalize to 0-1 range
+        for (int c = 0; c < channels; c += 4) {
+            int g = c / 4;
+            
+            // Process envelope
+            {
+                PROFILE_SCOPE(ENVELOPE_PROFILE);
+                float_4 gate = inputs[ENV_GATE_INPUT].getPolyVoltageSimd<float_4>(c) >= 1.f;
+                env[g].process(gate);
+                if (envOutput)
+                    outputs[ENV_OUT_OUTPUT].setVoltageSimd(10.f * env[g].output, c);
+            }
+            
+            // With every envelope of the group at rest the VCA is closed, so the
+            // mix and the filter are skipped. The filter is flushed on the way in,
+            // so it holds no decaying tail and wakes from silence on the next gate.
+            bool idle = gateConnected && simd::movemask(env[g].isIdle()) == 0xF;
+            if (idle && !groupIdle[g]) {
+                filter[g].reset();
+                filterRight[g].reset();
+                ampDecimator[g].reset();
+                ampDecimatorRight[g].reset();
+            }
+            groupIdle[g] = idle;
+            
+            // Oscillators and filter run factor times per engine sample
+            float_4 waveBuffer[3][WAVES_LEN][Decimator<float_4>::MAX_FACTOR];
+            float_4 mixBuffer[Decimator<float_4>::MAX_FACTOR];
+            float_4 mixRightBuffer[Decimator<float_4>::MAX_FACTOR];
+            float_4 ampBuffer[Decimator<float_4>::MAX_FACTOR];
+            float_4 ampRightBuffer[Decimator<float_4>::MAX_FACTOR];
+            {
+                PROFILE_SCOPE(OSCILLATORS_PROFILE);
+                
+                // When nothing is heard the oscillators only count samples. Their
+                // phases are caught up every control period and on waking, so the
+                // voices stay in step with each other.
+                bool asleep = idle && !anyWaveOutput;
+                if (asleep)
+                    idleSamples[g]++;
+                
+                if (!asleep || idleSamples[g] >= controlPeriod) {
+                    // Process V/Oct input at audio rate. One exp2 per voice is shared by
+                    // all three oscillators through their control-rate ratios.
+                    float_4 pitch = inputs[VOCT_INPUT].getPolyVoltageSimd<float_4>(c);
+                    float_4 baseFreq = dsp::FREQ_C4 * fastmath::exp2(pitch);
+                    if (packed)
+                        baseFreq = baseFreq[0];
+                    
+                    for (int i = 0; i < 3; i++) {
+                        // Process PWM at audio rate
+                        float_4 pw = 0.5f;
+                        if (waveActive[i][SQR_WAVE]) {
+                            float_4 pwmCV = inputs[OSC1_PWM_CV_INPUT + i].getPolyVoltageSimd<float_4>(c) * 0.1f;
+                            pw = simd::clamp(oscWidth[i] + oscPwmAmount[i] * pwmCV * 0.5f, 0.01f, 0.99f);
+                            if (packed)
+                                pw = pw[0];
+                        }
+                        
+                        for (int u = 0; u < oscCopies; u++) {
+                            BasicOscillator<float_4>& o = osc[i][g][u];
+                            o.freq = baseFreq * (packed ? packedRatio[i][u] : float_4(unisonRatio[i][u]));
+                            if (waveActive[i][SQR_WAVE])
+                                o.pw = pw;
+                            if (idleSamples[g] > 0)
+                                o.skipPhase(deltaTime, idleSamples[g]);
+                        }
+                    }
+                    idleSamples[g] = 0;
+                }
+                
+                if (!asleep) {
+                    for (int s = 0; s < factor; s++)
+                        mixBuffer[s] = 0.f;
+                    for (int i = 0; i < 3; i++) {
+                        for (int w = 0; w < WAVES_LEN; w++) {
+                            if (waveOutput[i][w]) {
+                                for (int s = 0; s < factor; s++)
+                                    waveBuffer[i][w][s] = 0.f;
+                            }
+                        }
+                    }
+                    
+                    if (packed) {
+                        // Each pack's lanes are weighted by their copies' gains
+                        // and summed into the voice
+                        for (int s = 0; s < factor; s++)
+                            mixRightBuffer[s] = 0.f;
+                        for (int k = 0; k < oscCopies; k++) {
+                            float_4 packWaves[3][WAVES_LEN][Decimator<float_4>::MAX_FACTOR];
+                            float_4 packBuffer[Decimator<float_4>::MAX_FACTOR];
+                            for (int s = 0; s < factor; s++)
+                                packBuffer[s] = 0.f;
+                            for (int i = 0; i < 3; i++) {
+                                for (int w = 0; w < WAVES_LEN; w++) {
+                                    if (waveOutput[i][w]) {
+                                        for (int s = 0; s < factor; s++)
+                                            packWaves[i][w][s] = 0.f;
+                                    }
+                                }
+                            }
+                            for (int i = 0; i < 3; i++)
+                                oscKernel[i](osc[i][0][k], subTime, factor, unisonLevel[i], packWaves[i], packBuffer);
+                            for (int s = 0; s < factor; s++) {
+                                for (int i = 0; i < 3; i++) {
+                                    for (int w = 0; w < WAVES_LEN; w++) {
+                                        if (waveOutput[i][w])
+                                            waveBuffer[i][w][s] += sumLanes(packedGain[k] * packWaves[i][w][s]);
+                                    }
+                                }
+                                mixBuffer[s] += sumLanes((stereo ? packedLeft[k] : packedGain[k]) * packBuffer[s]);
+                                if (stereo)
+                                    mixRightBuffer[s] += sumLanes(packedRight[k] * packBuffer[s]);
+                            }
+                        }
+                    }
+                    else if (stereo) {
+                        // Each copy's three oscillators are mixed, then panned
+                        for (int s = 0; s < factor; s++)
+                            mixRightBuffer[s] = 0.f;
+                        for (int u = 0; u < unisonVoices; u++) {
+                            float_4 copyBuffer[Decimator<float_4>::MAX_FACTOR];
+                            for (int s = 0; s < factor; s++)
+                                copyBuffer[s] = 0.f;
+                            for (int i = 0; i < 3; i++)
+                                oscKernel[i](osc[i][g][u], subTime, factor, unisonLevel[i], waveBuffer[i], copyBuffer);
+                            for (int s = 0; s < factor; s++) {
+                                mixBuffer[s] += unisonLeft[u] * copyBuffer[s];
+                                mixRightBuffer[s] += unisonRight[u] * copyBuffer[s];
+                            }
+                        }
+                    }
+                    else {
+                        for (int i = 0; i < 3; i++) {
+                            for (int u = 0; u < unisonVoices; u++)
+                                oscKernel[i](osc[i][g][u], subTime, factor, unisonLevel[i], waveBuffer[i], mixBuffer);
+                        }
+                    }
+                }
+            }
+            
+            if (ampActive && !idle) {
+                PROFILE_SCOPE(FILTER_PROFILE);
+                // Normalize the mix and process filter
+                for (int s = 0; s < factor; s++) {
+                    filter[g].process(mixBuffer[s] * (1.f / 9.f));
+                    ampBuffer[s] = filter[g].output;
+                }
+                if (stereo) {
+                    for (int s = 0; s < factor; s++) {
+                        filterRight[g].process(mixRightBuffer[s] * (1.f / 9.f));
+                        ampRightBuffer[s] = filterRight[g].output;
+                    }
+                }
+            }
+            
+            PROFILE_SCOPE(OUTPUT_PROFILE);
+            
+            // Set individual oscillator outputs
+            for (int i = 0; i < 3; i++) {
+                for (int w = 0; w < WAVES_LEN; w++) {
+                    if (!waveOutput[i][w])
+                        continue;
+                    Decimator<float_4>& d = waveDecimator[i][w][g];
+                    d.setFactor(factor);
+                    outputs[OSC1_TRI_OUTPUT + 3 * w + i].setVoltageSimd(5.f * d.process(waveBuffer[i][w]), c);
+                }
+            }
+            
+            if (!ampActive)
+                continue;
+            if (idle) {
+                outputs[AMP_OUT_OUTPUT].setVoltageSimd(float_4::zero(), c);
+                outputs[AMP_OUT_RIGHT_OUTPUT].setVoltageSimd(float_4::zero(), c);
+                continue;
+            }
+            
+            ampDecimator[g].setFactor(factor);
+            float_4 filtered = ampDecimator[g].process(ampBuffer);
+            
+            // Process VCA
+            float_4 vcaCV = inputs[AMP_CV_INPUT].getPolyVoltageSimd<float_4>(c) * 0.1f; // Normalize to 0-1 range
+            
+            // Final output stage with envelope modulation
+            float_4 finalOutput = filtered * vcaGain * (1.f + vcaCV);
+            if (gateConnected) {
+                finalOutput *= env[g].output;
+            }
+            
+            // Set VCA output
+            outputs[AMP_OUT_OUTPUT].setVoltageSimd(5.f * finalOutput, c);
+            
+            // Without a stereo spread the right output repeats the left
+            if (stereo) {
+                ampDecimatorRight[g].setFactor(factor);
+                float_4 rightOutput = ampDecimatorRight[g].process(ampRightBuffer) * vcaGain * (1.f + vcaCV);
+                if (gateConnected)
+                    rightOutput *= env[g].output;
+                finalOutput = rightOutput;
+            }
+            outputs[AMP_OUT_RIGHT_OUTPUT].setVoltageSimd(5.f * finalOutput, c);
+        }
         
-        float finalOutput = 0.f;
-        // Final output stage with envelope modulation
-        if (inputs[ENV_GATE_INPUT].isConnected()) {
-            finalOutput = filter.output * vcaGain * (1.f + vcaCV) * env.output;
-        else {
-            finalOutput = filter.output * vcaGain * (1.f + vcaCV);
+        // Per-voice outputs follow the voice count, the LFOs stay monophonic
+        for (int i = OSC1_TRI_OUTPUT; i <= OSC3_SQR_OUTPUT; i++) {
+            outputs[i].setChannels(channels);
         }
+        outputs[ENV_OUT_OUTPUT].setChannels(channels);
+        outputs[AMP_OUT_OUTPUT].setChannels(channels);
+        outputs[AMP_OUT_RIGHT_OUTPUT].setChannels(channels);
+    }
+};
+
+
+// Flattened so every waveform call is inlined into each specialization,
+// which GCC's inlining limits otherwise stop short of with this many of them
+template <int QUALITY, int OUTPUT, int MIXED>
+__attribute__((flatten)) static void oscKernel(BasicOscillator<float_4>& osc, float deltaTime, int steps, const float* levels, float_4 (*waves)[Decimator<float_4>::MAX_FACTOR], float_4* mix) {
+    const int TRI = Sub_osc::TRI_WAVE;
+    const int SAW = Sub_osc::SAW_WAVE;
+    const int SQR = Sub_osc::SQR_WAVE;
+    const bool naive = (QUALITY == Sub_osc::NAIVE_QUALITY);
+    const bool minBlep = (QUALITY == Sub_osc::MINBLEP_QUALITY);
+    const int ACTIVE = OUTPUT | MIXED;
+    
+    for (int s = 0; s < steps; s++) {
+        if (minBlep)
+            osc.updatePhaseMinBlep(deltaTime);
+        else
+            osc.updatePhase(deltaTime);
         
-        // Set VCA output
-        outputs[AMP_OUT_OUTPUT].setVoltage(5.f * finalOutput);
+        if (ACTIVE & (1 << TRI)) {
+            float_4 wave = (naive ? osc.triangle() : osc.triangleBlep()) * levels[TRI];
+            if (OUTPUT & (1 << TRI))
+                waves[TRI][s] += wave;
+            if (MIXED & (1 << TRI))
+                mix[s] += wave;
+        }
+        // The minBLEP residual generators are always drained so no stale
+        // residual plays when a waveform becomes active again
+        if ((ACTIVE & (1 << SAW)) || minBlep) {
+            float_4 wave = (naive ? osc.saw() : minBlep ? osc.sawMinBlepOut() : osc.sawBlep()) * levels[SAW];
+            if (OUTPUT & (1 << SAW))
+                waves[SAW][s] += wave;
+            if (MIXED & (1 << SAW))
+                mix[s] += wave;
+        }
+        if ((ACTIVE & (1 << SQR)) || minBlep) {
+            float_4 wave = (naive ? osc.square() : minBlep ? osc.squareMinBlepOut() : osc.squareBlep()) * levels[SQR];
+            if (OUTPUT & (1 << SQR))
+                waves[SQR][s] += wave;
+            if (MIXED & (1 << SQR))
+                mix[s] += wave;
+        }
     }
+}
+
+// Fills the kernel table with every combination, flattened into one index
+static const int OSC_KERNEL_SETS = 1 << Sub_osc::WAVES_LEN;
+static const int OSC_KERNELS_LEN = Sub_osc::QUALITIES_LEN * OSC_KERNEL_SETS * OSC_KERNEL_SETS;
+
+template <int I>
+struct OscKernelTable {
+    static void fill(OscKernel* table) {
+        table[I] = &oscKernel<I / (OSC_KERNEL_SETS * OSC_KERNEL_SETS), (I / OSC_KERNEL_SETS) % OSC_KERNEL_SETS, I % OSC_KERNEL_SETS>;
+        OscKernelTable<I - 1>::fill(table);
+    }
+};
+
+template <>
+struct OscKernelTable<-1> {
+    static void fill(OscKernel* table) {}
 };
 
+static OscKernel getOscKernel(int quality, int active, int mixed) {
+    static OscKernel table[OSC_KERNELS_LEN];
+    static bool filled = (OscKernelTable<OSC_KERNELS_LEN - 1>::fill(table), true);
+    (void) filled;
+    return table[(quality * OSC_KERNEL_SETS + active) * OSC_KERNEL_SETS + mixed];
+}
+
 
 struct Sub_oscWidget : ModuleWidget {
 	Sub_oscWidget(Sub_osc* module) {
@@ -410,6 +839,11 @@ struct Sub_oscWidget : ModuleWidget {
 		addParam(createParamCentered<RoundBlackKnob>(mm2px(Vec(23.0, 111.3)), module, Sub_osc::ENV_RELEASE_PARAM));
 		addParam(createParamCentered<RoundBlackKnob>(mm2px(Vec(49.0, 111.3)), module, Sub_osc::LFO1_FREQ_PARAM));
 		addParam(createParamCentered<RoundBlackKnob>(mm2px(Vec(75.0, 111.3)), module, Sub_osc::LFO2_LEVEL_PARAM));
+		addParam(createParamCentered<RoundBlackKnob>(mm2px(Vec(114.0, 81.3)), module, Sub_osc::FILTER_RES_PARAM));
+		addParam(createParamCentered<CKSSThree>(mm2px(Vec(127.0, 81.3)), module, Sub_osc::FILTER_MODE_PARAM));
+		addParam(createParamCentered<CKSS>(mm2px(Vec(140.0, 81.3)), module, Sub_osc::FILTER_SLOPE_PARAM));
+		addParam(createParamCentered<RoundBlackKnob>(mm2px(Vec(49.0, 66.3)), module, Sub_osc::UNISON_DETUNE_PARAM));
+		addParam(createParamCentered<RoundBlackKnob>(mm2px(Vec(75.0, 66.3)), module, Sub_osc::UNISON_SPREAD_PARAM));
 		
 		addInput(createInputCentered<PJ301MPort>(mm2px(Vec(10.0, 16.3)), module, Sub_osc::VOCT_INPUT));
 		addInput(createInputCentered<PJ301MPort>(mm2px(Vec(10.0, 46.3)), module, Sub_osc::OSC1_PWM_CV_INPUT));
@@ -432,6 +866,53 @@ struct Sub_oscWidget : ModuleWidget {
 		addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(36.0, 111.3)), module, Sub_osc::ENV_OUT_OUTPUT));
 		addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(62.0, 111.3)), module, Sub_osc::LFO1_OUT_OUTPUT));
 		addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(101.0, 111.3)), module, Sub_osc::AMP_OUT_OUTPUT));
+		addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(114.0, 111.3)), module, Sub_osc::AMP_OUT_RIGHT_OUTPUT));
+	}
+
+	void appendContextMenu(Menu* menu) override {
+		Sub_osc* module = getModule<Sub_osc>();
+
+		menu->addChild(new MenuSeparator);
+		menu->addChild(createIndexPtrSubmenuItem("Anti-aliasing", {"Off", "PolyBLEP", "minBLEP (HQ)"}, &module->quality));
+
+		static const std::vector<int> divisions = {1, 4, 8, 16, 32, 64};
+		std::vector<std::string> divisionLabels;
+		for (int division : divisions)
+			divisionLabels.push_back(division == 1 ? "Every sample" : string::f("Every %d samples", division));
+		menu->addChild(createIndexSubmenuItem("Parameter update rate", divisionLabels,
+			[=]() {
+				auto it = std::find(divisions.begin(), divisions.end(), module->controlDivision);
+				return it == divisions.end() ? 0 : it - divisions.begin();
+			},
+			[=](size_t index) {
+				module->setControlDivision(divisions[index]);
+			}
+		));
+
+		menu->addChild(createIndexSubmenuItem("Oversampling", {"Off", "2x", "4x", "8x"},
+			[=]() {
+				return (size_t) std::log2(module->oversample);
+			},
+			[=](size_t index) {
+				module->setOversample(1 << index);
+			}
+		));
+
+		std::vector<std::string> unisonLabels;
+		for (int voices = 1; voices <= Sub_osc::MAX_UNISON; voices++)
+			unisonLabels.push_back(voices == 1 ? "Off" : string::f("%d voices", voices));
+		menu->addChild(createIndexSubmenuItem("Unison", unisonLabels,
+			[=]() {
+				return (size_t) module->unison - 1;
+			},
+			[=](size_t index) {
+				module->unison = index + 1;
+			}
+		));
+
+#ifdef ASTROKKIDD_PROFILE
+		module->profiler.appendContextMenu(menu, module->model->slug);
+#endif
 	}
 };
 
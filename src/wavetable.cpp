@@ -0,0 +1,294 @@
+#include "wavetable.hpp"
+#include <map>
+#include <mutex>
+#if defined ARCH_WIN
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+
+// Rack's simd shifts take the count by reference, which needs a definition
+const int SineTable::FRAC_SHIFT;
+
+
+SineTable::SineTable() {
+	for (int i = 0; i <= SIZE; i++) {
+		samples[i] = (float) std::sin(2.0 * M_PI * i / SIZE);
+	}
+}
+
+
+const SineTable& getSineTable() {
+	// Function-local statics are initialized once, thread-safely, on first call
+	static const SineTable table;
+	return table;
+}
+
+
+// A read-only view of a whole file. The WAV parser reads samples straight out
+// of the mapping, so even a large wavetable is never copied before its
+// mipmaps are built.
+struct MappedFile {
+	const uint8_t* data = nullptr;
+	size_t size = 0;
+#if defined ARCH_WIN
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#endif
+
+	bool open(const std::string& path) {
+#if defined ARCH_WIN
+		file = CreateFileW(string::UTF8toUTF16(path).c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+			return false;
+		mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (!mapping)
+			return false;
+		data = (const uint8_t*) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		size = fileSize.QuadPart;
+#else
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p != MAP_FAILED) {
+				data = (const uint8_t*) p;
+				size = st.st_size;
+			}
+		}
+		// The mapping outlives the descriptor
+		::close(fd);
+#endif
+		return data != nullptr;
+	}
+
+	~MappedFile() {
+#if defined ARCH_WIN
+		if (data)
+			UnmapViewOfFile(data);
+		if (mapping)
+			CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+#else
+		if (data)
+			munmap((void*) data, size);
+#endif
+	}
+};
+
+
+// Odr-used by lookupPhase(), as SineTable's
+const int UserWavetable::FRAC_SHIFT;
+
+
+static uint32_t readLE(const uint8_t* p, int bytes) {
+	uint32_t v = 0;
+	for (int i = 0; i < bytes; i++)
+		v |= (uint32_t) p[i] << (8 * i);
+	return v;
+}
+
+
+// Decodes the first channel of a RIFF WAVE file, which may be 8, 16, 24 or
+// 32-bit integer PCM or 32-bit float. Serum writes its frame size into a
+// "clm " chunk as "<!>2048"; it is returned in `frameSize` when present.
+static bool decodeWav(const MappedFile& file, std::vector<float>* out, int* frameSize, std::string* error) {
+	const uint8_t* p = file.data;
+	const uint8_t* end = file.data + file.size;
+	if (file.size < 12 || std::memcmp(p, "RIFF", 4) || std::memcmp(p + 8, "WAVE", 4)) {
+		*error = "not a WAV file";
+		return false;
+	}
+
+	int format = 0;
+	int channels = 0;
+	int bits = 0;
+	const uint8_t* samples = nullptr;
+	size_t samplesSize = 0;
+
+	for (p += 12; p + 8 <= end;) {
+		const uint8_t* chunk = p + 8;
+		size_t chunkSize = std::min<size_t>(readLE(p + 4, 4), end - chunk);
+		if (!std::memcmp(p, "fmt ", 4) && chunkSize >= 16) {
+			format = readLE(chunk, 2);
+			channels = readLE(chunk + 2, 2);
+			bits = readLE(chunk + 14, 2);
+			// WAVE_FORMAT_EXTENSIBLE keeps the real format in its subformat GUID
+			if (format == 0xFFFE && chunkSize >= 26)
+				format = readLE(chunk + 24, 2);
+		}
+		else if (!std::memcmp(p, "data", 4)) {
+			samples = chunk;
+			samplesSize = chunkSize;
+		}
+		else if (!std::memcmp(p, "clm ", 4) && chunkSize > 3 && !std::memcmp(chunk, "<!>", 3)) {
+			*frameSize = std::atoi(std::string((const char*) chunk + 3, std::min<size_t>(chunkSize - 3, 8)).c_str());
+		}
+		// Chunks are padded to an even size
+		p = chunk + chunkSize + (chunkSize & 1);
+	}
+
+	bool isInt = (format == 1 && (bits == 8 || bits == 16 || bits == 24 || bits == 32));
+	bool isFloat = (format == 3 && bits == 32);
+	if (!samples || channels < 1 || !(isInt || isFloat)) {
+		*error = "unsupported WAV format";
+		return false;
+	}
+
+	int bytes = bits / 8;
+	size_t stride = (size_t) bytes * channels;
+	size_t length = samplesSize / stride;
+	if (length == 0) {
+		*error = "WAV file is empty";
+		return false;
+	}
+	out->resize(length);
+	for (size_t i = 0; i < length; i++) {
+		const uint8_t* s = samples + i * stride;
+		if (isFloat) {
+			uint32_t v = readLE(s, 4);
+			float f;
+			std::memcpy(&f, &v, 4);
+			(*out)[i] = f;
+		}
+		else if (bits == 8) {
+			// 8-bit WAV is unsigned
+			(*out)[i] = (s[0] - 128) * (1.f / 128.f);
+		}
+		else {
+			// Shift the sample into the top of an int32 to sign-extend it
+			int32_t v = (int32_t) (readLE(s, bytes) << (32 - bits));
+			(*out)[i] = v * (1.f / 2147483648.f);
+		}
+	}
+	return true;
+}
+
+
+// Fills every mipmap level of one frame from its spectrum, in dsp::RealFFT's
+// ordered format with DC and Nyquist cleared.
+static void buildMipmaps(dsp::RealFFT& fft, const float* spectrum, float* out) {
+	typedef UserWavetable W;
+	alignas(16) float filtered[W::SIZE];
+	// The FFT needs aligned buffers, which mipmap rows are not
+	alignas(16) float level[W::SIZE];
+
+	for (int l = 0; l < W::LEVELS; l++) {
+		int harmonics = W::MAX_HARMONIC >> l;
+		std::copy(spectrum, spectrum + W::SIZE, filtered);
+		for (int k = harmonics + 1; k < W::SIZE / 2; k++) {
+			filtered[2 * k] = 0.f;
+			filtered[2 * k + 1] = 0.f;
+		}
+
+		fft.irfft(filtered, level);
+		fft.scale(level);
+		float* row = out + l * W::STRIDE;
+		std::copy(level, level + W::SIZE, row);
+		row[W::SIZE] = row[0];
+	}
+}
+
+
+static std::shared_ptr<UserWavetable> buildUserWavetable(const std::string& path, std::string* error) {
+	typedef UserWavetable W;
+
+	MappedFile file;
+	if (!file.open(path)) {
+		*error = "could not open file";
+		return nullptr;
+	}
+	std::vector<float> wav;
+	int frameSize = 0;
+	if (!decodeWav(file, &wav, &frameSize, error))
+		return nullptr;
+
+	int length = wav.size();
+	if (frameSize <= 0 || length % frameSize != 0)
+		frameSize = (length % W::SIZE == 0) ? W::SIZE : length;
+
+	std::shared_ptr<UserWavetable> table = std::make_shared<UserWavetable>();
+	table->path = path;
+	table->frames = std::min(length / frameSize, (int) W::MAX_FRAMES);
+	table->samples.resize((size_t) table->frames * W::LEVELS * W::STRIDE);
+
+	dsp::RealFFT fft(W::SIZE);
+	alignas(16) float frame[W::SIZE];
+	alignas(16) float spectrum[W::SIZE];
+	float peak = 0.f;
+
+	for (int f = 0; f < table->frames; f++) {
+		// Resample other cycle lengths to the table size, wrapping at the end
+		const float* src = &wav[(size_t) f * frameSize];
+		for (int i = 0; i < W::SIZE; i++) {
+			float pos = (float) i * frameSize / W::SIZE;
+			int index = (int) pos;
+			float frac = pos - index;
+			frame[i] = src[index] + frac * (src[(index + 1) % frameSize] - src[index]);
+		}
+
+		fft.rfft(frame, spectrum);
+		// Drop DC and the Nyquist bin, which every level leaves out anyway
+		spectrum[0] = 0.f;
+		spectrum[1] = 0.f;
+
+		float* out = &table->samples[f * W::LEVELS * W::STRIDE];
+		buildMipmaps(fft, spectrum, out);
+		for (int i = 0; i < W::SIZE; i++)
+			peak = std::max(peak, std::fabs(out[i]));
+	}
+
+	// Normalize to the sine table's unit amplitude
+	if (peak > 0.f) {
+		for (float& s : table->samples)
+			s /= peak;
+	}
+	return table;
+}
+
+
+std::shared_ptr<const UserWavetable> loadUserWavetable(const std::string& path, std::string* error) {
+	// Holding the lock through the build means instances loading the same
+	// file together, as when a patch opens, wait for one build and share it.
+	static std::mutex cacheMutex;
+	static std::map<std::string, std::weak_ptr<const UserWavetable>> cache;
+
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	std::shared_ptr<const UserWavetable> table = cache[path].lock();
+	if (table)
+		return table;
+
+	table = buildUserWavetable(path, error);
+	if (table)
+		cache[path] = table;
+	else
+		cache.erase(path);
+	return table;
+}
+
+
+std::shared_ptr<const UserWavetable> renderHarmonicWavetable(const float* amplitudes, int count) {
+	typedef UserWavetable W;
+	std::shared_ptr<UserWavetable> table = std::make_shared<UserWavetable>();
+	table->frames = 1;
+	table->samples.resize(W::LEVELS * W::STRIDE);
+
+	// A sine of amplitude a at bin k has an imaginary part of -a * SIZE / 2
+	alignas(16) float spectrum[W::SIZE] = {};
+	for (int k = 1; k <= std::min(count, W::MAX_HARMONIC - 1); k++)
+		spectrum[2 * k + 1] = -amplitudes[k - 1] * (W::SIZE / 2);
+
+	dsp::RealFFT fft(W::SIZE);
+	buildMipmaps(fft, spectrum, &table->samples[0]);
+	return table;
+}
@@ -0,0 +1,218 @@
+#pragma once
+#include "plugin.hpp"
+#include <atomic>
+
+
+// One cycle of sine, built once per plugin load and shared read-only by every
+// module instance. The size is a power of two so the index wraps with a mask.
+struct SineTable {
+	static const int SIZE_BITS = 12;
+	static const int SIZE = 1 << SIZE_BITS;
+	static const int MASK = SIZE - 1;
+
+	// One guard sample past the end so interpolation never needs to wrap
+	float samples[SIZE + 1];
+
+	SineTable();
+
+	// Linearly interpolated lookup, phase in [0, 1)
+	float lookup(float phase) const {
+		float pos = phase * SIZE;
+		int index = (int) pos;
+		float frac = pos - index;
+		index &= MASK;
+		return samples[index] + frac * (samples[index + 1] - samples[index]);
+	}
+
+	// Four lookups at once. SSE has no gather, so only the loads are scalar.
+	simd::float_4 lookup(simd::float_4 phase) const {
+		simd::float_4 pos = phase * SIZE;
+		simd::float_4 posFloor = simd::floor(pos);
+		simd::float_4 frac = pos - posFloor;
+		simd::int32_4 index = simd::int32_4(posFloor) & MASK;
+		simd::float_4 a, b;
+		for (int i = 0; i < 4; i++) {
+			a[i] = samples[index[i]];
+			b[i] = samples[index[i] + 1];
+		}
+		return a + frac * (b - a);
+	}
+
+	// Lookups from a 32-bit fixed-point phase (see phase.hpp). The top bits
+	// index the table directly and the next 16 interpolate.
+	static const int FRAC_SHIFT = 32 - SIZE_BITS - 16;
+
+	float lookupPhase(uint32_t phase) const {
+		uint32_t index = phase >> (32 - SIZE_BITS);
+		float frac = ((phase >> FRAC_SHIFT) & 0xFFFF) * (1.f / 65536.f);
+		return samples[index] + frac * (samples[index + 1] - samples[index]);
+	}
+
+	simd::float_4 lookupPhase(simd::int32_4 phase) const {
+		simd::int32_4 index = (phase >> (32 - SIZE_BITS)) & MASK;
+		simd::float_4 frac = simd::float_4((phase >> FRAC_SHIFT) & 0xFFFF) * (1.f / 65536.f);
+		simd::float_4 a, b;
+		for (int i = 0; i < 4; i++) {
+			a[i] = samples[index[i]];
+			b[i] = samples[index[i] + 1];
+		}
+		return a + frac * (b - a);
+	}
+};
+
+// Returns the shared table, building it on first use
+const SineTable& getSineTable();
+
+
+// A user wavetable loaded from a WAV file: one or more single-cycle frames,
+// each stored as a set of band-limited mipmap levels. Level L keeps the first
+// MAX_HARMONIC >> L harmonics, so a partial reads the richest level that
+// still fits below Nyquist. Tables are immutable once built and shared by
+// every instance that loads the same file (see loadUserWavetable()).
+struct UserWavetable {
+	static const int SIZE_BITS = 11;
+	static const int SIZE = 1 << SIZE_BITS;
+	static const int MASK = SIZE - 1;
+	static const int MAX_HARMONIC = SIZE / 2;
+	static const int LEVELS = SIZE_BITS;
+	// One guard sample past the end, as in SineTable
+	static const int STRIDE = SIZE + 1;
+	static const int MAX_FRAMES = 256;
+	static const int FRAC_SHIFT = 32 - SIZE_BITS - 16;
+
+	std::string path;
+	int frames = 0;
+	// Indexed by (frame * LEVELS + level) * STRIDE
+	std::vector<float> samples;
+
+	const float* getLevel(int frame, int level) const {
+		return &samples[(frame * LEVELS + level) * STRIDE];
+	}
+
+	/** Returns the mipmap level for a phase increment in cycles per sample. */
+	static int getMipLevel(float increment) {
+		// Level L is alias-free while (MAX_HARMONIC >> L) * increment <= 0.5
+		int exponent;
+		std::frexp(increment * (2 * MAX_HARMONIC), &exponent);
+		return clamp(exponent, 0, LEVELS - 1);
+	}
+
+	float lookupPhase(uint32_t phase, int level) const {
+		const float* s = getLevel(0, level) + (phase >> (32 - SIZE_BITS));
+		float frac = ((phase >> FRAC_SHIFT) & 0xFFFF) * (1.f / 65536.f);
+		return s[0] + frac * (s[1] - s[0]);
+	}
+
+	/** Four lookups from a fixed-point phase (see phase.hpp), each lane at its
+	 * own mipmap level, crossfading between `frame` and the next frame by
+	 * `frameFrac`. */
+	simd::float_4 lookupPhase(simd::int32_4 phase, simd::int32_4 level, int frame, float frameFrac) const {
+		int nextFrame = std::min(frame + 1, frames - 1);
+		simd::int32_4 index = (phase >> (32 - SIZE_BITS)) & MASK;
+		simd::float_4 frac = simd::float_4((phase >> FRAC_SHIFT) & 0xFFFF) * (1.f / 65536.f);
+		simd::float_4 a, b;
+		for (int i = 0; i < 4; i++) {
+			const float* s0 = getLevel(frame, level[i]) + index[i];
+			const float* s1 = getLevel(nextFrame, level[i]) + index[i];
+			a[i] = s0[0] + frameFrac * (s1[0] - s0[0]);
+			b[i] = s0[1] + frameFrac * (s1[1] - s0[1]);
+		}
+		return a + frac * (b - a);
+	}
+};
+
+/** Loads a mono or multichannel WAV as a wavetable, reading the first
+ * channel. Serum-style files hold consecutive 2048-sample frames; any other
+ * length is taken as a single cycle. Instances asking for the same path get
+ * the same table for as long as one of them holds it. This blocks while the
+ * mipmaps are built, so call it from a worker thread. Returns null and sets
+ * `error` on failure.
+ */
+std::shared_ptr<const UserWavetable> loadUserWavetable(const std::string& path, std::string* error);
+
+/** Renders the single cycle sum of amplitudes[k - 1] * sin(2 pi k phase) for
+ * harmonics 1 to count, with the same mipmap levels as a loaded table. This
+ * runs FFTs, so call it from a worker thread.
+ */
+std::shared_ptr<const UserWavetable> renderHarmonicWavetable(const float* amplitudes, int count);
+
+
+// Hands immutable tables from a worker thread to the audio thread without
+// locks. The worker publishes a table into the pending slot, and the audio
+// thread hands back the table it replaced through the retired slots, so
+// tables are never freed on the audio thread. The replaced table stays
+// readable as `previous` until the audio thread is done crossfading from it.
+struct WavetableExchange {
+	typedef std::shared_ptr<const UserWavetable> Ref;
+
+	// Tables the audio thread has given back, freed by the next publish(). One
+	// swap happens per publish, so at most two are ever waiting.
+	static constexpr int RETIRED_SLOTS = 4;
+
+	std::atomic<Ref*> pending{nullptr};
+	std::atomic<Ref*> retired[RETIRED_SLOTS];
+	// Owned by the audio thread
+	Ref* active = nullptr;
+	Ref* previous = nullptr;
+
+	WavetableExchange() {
+		for (int i = 0; i < RETIRED_SLOTS; i++)
+			retired[i].store(nullptr);
+	}
+
+	~WavetableExchange() {
+		delete pending.load();
+		drainRetired();
+		delete active;
+		delete previous;
+	}
+
+	/** Called off the audio thread */
+	void drainRetired() {
+		for (int i = 0; i < RETIRED_SLOTS; i++)
+			delete retired[i].exchange(nullptr, std::memory_order_acquire);
+	}
+
+	/** Called off the audio thread. A null table unloads. */
+	void publish(Ref table) {
+		drainRetired();
+		// A table the audio thread never picked up can go straight away
+		delete pending.exchange(new Ref(table));
+	}
+
+	/** Called on the audio thread. Returns whether a new table was taken. */
+	bool swap() {
+		if (previous || !pending.load(std::memory_order_relaxed))
+			return false;
+		Ref* next = pending.exchange(nullptr, std::memory_order_acquire);
+		if (!next)
+			return false;
+		previous = active;
+		active = next;
+		return true;
+	}
+
+	/** Called on the audio thread once `previous` is no longer read. Only
+	 * the audio thread fills slots, so a slot seen empty stays empty until it
+	 * is filled. If every slot is taken, `previous` is kept and the next swap
+	 * waits for publish() to drain them. */
+	void releasePrevious() {
+		if (!previous)
+			return;
+		for (int i = 0; i < RETIRED_SLOTS; i++) {
+			if (!retired[i].load(std::memory_order_relaxed)) {
+				retired[i].store(previous, std::memory_order_release);
+				previous = nullptr;
+				return;
+			}
+		}
+	}
+
+	const UserWavetable* get() const {
+		return active ? active->get() : nullptr;
+	}
+
+	const UserWavetable* getPrevious() const {
+		return previous ? previous->get() : nullptr;
+	}
+};